@@ -0,0 +1,390 @@
+/*
+================================================================================
+
+    tinyMMO - an attempt to write a simple MMO-RPG in my spare time
+    (micro benchmarks of the server hot paths)
+    written by Sebastian Steinhauer <s.steinhauer@yahoo.de>
+
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <https://unlicense.org>
+
+================================================================================
+*/
+/*==[[ Includes ]]============================================================*/
+#define _GNU_SOURCE // recvmmsg() and friends
+
+// system headers first, so the allocation counters below only touch the server code
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+
+// count every allocation the server makes while a benchmark runs
+static uint64_t bench_allocs;
+#define malloc(size)            (bench_allocs++, malloc(size))
+#define calloc(count, size)     (bench_allocs++, calloc(count, size))
+#define realloc(memory, size)   (bench_allocs++, realloc(memory, size))
+#define mmap(...)               (bench_allocs++, mmap(__VA_ARGS__))
+
+// pull in the whole server, we want to measure its static functions
+#define main server_main
+#include "server.c"
+#undef main
+#undef malloc
+#undef calloc
+#undef realloc
+#undef mmap
+
+
+/*==[[ Defines / Enums ]]======================================================*/
+enum {
+    BENCH_CLIENTS               = 4096, // client capacity of the benchmark worker
+    BENCH_ADDRESSES             = 1 << 16, // random addresses we cycle through (power of two)
+    BENCH_TIME_MS               = 200, // run every benchmark for at least 200ms
+};
+
+
+/*==[[ Global State ]]========================================================*/
+
+static struct bench_t {
+    worker_t                    worker; // worker with the tables under test
+    address_t                   *addrs; // random client addresses (every other one IPv6)
+    FILE                        *output; // machine readable results (CSV)
+    volatile uint64_t           sink; // keeps the compiler from removing our loops
+    int                         shared; // clients watch this many shared screens in the tick sweep (0 = own video)
+} bench;
+
+
+/*==[[ Helper Functions ]]====================================================*/
+
+// return the next pseudo random number (xorshift, reproducible between runs)
+static uint32_t next_random(void) {
+    static uint32_t x = 2463534242u;
+    x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+    return x;
+}
+
+// disconnect every client of the benchmark worker
+static void reset_worker(void) {
+    worker_t *worker = &bench.worker;
+    while (worker->active_count > 0)
+        destroy_client(worker, worker->active[0]);
+    reset_packets(worker);
+}
+
+// connect the first count addresses
+static void fill_worker(const int count) {
+    reset_worker();
+    for (int i = 0; i < count; ++i)
+        create_client(&bench.worker, bench.addrs[i]);
+}
+
+// run a benchmark with growing iteration counts until it takes long enough, then report it
+static void run_bench(const char *name, void (*bench_fn)(uint64_t iterations), const uint64_t ops_per_iteration) {
+    for (uint64_t iterations = 1;; iterations *= 2) {
+        bench_allocs = 0;
+        const uint64_t start = get_nanos();
+        bench_fn(iterations);
+        const uint64_t elapsed = get_nanos() - start;
+        if ((elapsed < BENCH_TIME_MS * 1000000ull) && (iterations < (1ull << 40))) continue;
+        const uint64_t ops = iterations * ops_per_iteration;
+        const double ns_per_op = (double)elapsed / (double)ops;
+        const double allocs_per_op = (double)bench_allocs / (double)ops;
+        printf("%-32s %12llu ops %10.2f ns/op %8.3f allocs/op\n", name, (unsigned long long)ops, ns_per_op, allocs_per_op);
+        fprintf(bench.output, "%s,%llu,%.3f,%.6f\n", name, (unsigned long long)ops, ns_per_op, allocs_per_op);
+        return;
+    }
+}
+
+
+/*==[[ Benchmarks ]]==========================================================*/
+
+// write and read back a 32-bit integer
+static void bench_uint32(uint64_t iterations) {
+    uint8_t data[4];
+    uint32_t sum = 0;
+    for (uint64_t i = 0; i < iterations; ++i) {
+        write_uint32(data, (uint32_t)i ^ sum);
+        sum += read_uint32(data);
+    }
+    bench.sink = sum;
+}
+
+// encode and decode an input packet (what arrives from every client each tick)
+static void bench_input_codec(uint64_t iterations) {
+    uint8_t data[PACKET_INPUT_SIZE];
+    uint32_t sum = 0;
+    for (uint64_t i = 0; i < iterations; ++i) {
+        input_packet_t input = { .tick = (uint32_t)i, .buttons = (uint8_t)sum, .ack = (uint32_t)i ^ sum, .count = 4 };
+        encode_input(data, &input);
+        if (decode_input(data, sizeof(data), &input) != NULL)
+            sum += input.tick + input.buttons + input.ack + input.count;
+    }
+    bench.sink = sum;
+}
+
+// encode and decode a frame header (what goes out to every client each tick)
+static void bench_frame_codec(uint64_t iterations) {
+    uint8_t data[PACKET_FRAME_SIZE];
+    uint32_t sum = 0;
+    for (uint64_t i = 0; i < iterations; ++i) {
+        frame_packet_t frame = { .tick = (uint32_t)i, .audio = sum, .music = (uint8_t)i, .base = (uint32_t)i - 1 };
+        encode_frame(data, &frame);
+        if (decode_frame(data, sizeof(data), &frame) != NULL)
+            sum += frame.tick + frame.audio + frame.music + frame.base;
+    }
+    bench.sink = sum;
+}
+
+// feed random packets to every decoder, whatever one accepts has to encode back to the same bytes
+static void bench_codec_fuzz(uint64_t iterations) {
+    uint8_t data[32], copy[32];
+    for (uint64_t i = 0; i < iterations; ++i) {
+        const int length = (int)(next_random() % sizeof(data));
+        for (int j = 0; j < length; ++j)
+            data[j] = (uint8_t)next_random();
+        // most packets get a valid header, so the field decoders run as well
+        if ((length >= 2) && (next_random() % 4 != 0)) {
+            data[0] = PROTOCOL_VERSION;
+            data[1] = (uint8_t)(next_random() % 6);
+        }
+#define FUZZ_PACKET(name, type, FIELDS) { \
+            name##_packet_t packet; \
+            const bool valid = (length >= type##_SIZE) && (data[0] == PROTOCOL_VERSION) && (data[1] == type); \
+            const uint8_t *payload = decode_##name(data, length, &packet); \
+            if ((payload != NULL) != valid) \
+                panic("decode_" #name "() %s a packet of %d bytes", valid ? "rejected" : "accepted", length); \
+            if (valid && ((payload != &data[type##_SIZE]) || (encode_##name(copy, &packet) != &copy[type##_SIZE]) || memcmp(copy, data, type##_SIZE))) \
+                panic(#name " packets do not decode and encode back to the same bytes"); \
+        }
+        PROTOCOL_PACKETS(FUZZ_PACKET)
+#undef FUZZ_PACKET
+    }
+}
+
+// change random tiles, whatever encode_delta() produces has to decode back to the same video
+static void bench_delta_fuzz(uint64_t iterations) {
+    uint8_t base[VIDEO_ROWS][VIDEO_COLS], video[VIDEO_ROWS][VIDEO_COLS], decoded[VIDEO_ROWS][VIDEO_COLS];
+    uint8_t data[VIDEO_ROWS * VIDEO_COLS];
+    for (uint64_t i = 0; i < iterations; ++i) {
+        for (int y = 0; y < VIDEO_ROWS; ++y)
+            for (int x = 0; x < VIDEO_COLS; ++x)
+                base[y][x] = (uint8_t)next_random();
+        memcpy(video, base, sizeof(video));
+        const int changes = (int)(next_random() % (VIDEO_ROWS * VIDEO_COLS));
+        for (int j = 0; j < changes; ++j)
+            video[next_random() % VIDEO_ROWS][next_random() % VIDEO_COLS] = (uint8_t)next_random();
+        const int length = encode_delta(data, (const uint8_t (*)[VIDEO_COLS])base, (const uint8_t (*)[VIDEO_COLS])video);
+        if (length < 0) continue;
+        memcpy(decoded, base, sizeof(decoded));
+        if (!decode_delta(decoded, data, length) || memcmp(decoded, video, sizeof(video)))
+            panic("a delta of %d bytes does not decode back to the same video", length);
+        if ((length > 2) && decode_delta(decoded, data, length - 1))
+            panic("decode_delta() accepted a delta cut short to %d bytes", length - 1);
+    }
+}
+
+// hash client addresses
+static void bench_hash_address(uint64_t iterations) {
+    uint32_t sum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+        sum += hash_address(&bench.addrs[i & (BENCH_ADDRESSES - 1)]);
+    bench.sink = sum;
+}
+
+// compare client addresses (the index compares against the stored session address)
+static void bench_same_address(uint64_t iterations) {
+    uint32_t sum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+        sum += same_address(&bench.addrs[i & (BENCH_ADDRESSES - 1)], &bench.addrs[(i + (i & 1)) & (BENCH_ADDRESSES - 1)]);
+    bench.sink = sum;
+}
+
+// look up connected clients (what every received packet does)
+static void bench_lookup_hit(uint64_t iterations) {
+    uint32_t sum = 0;
+    const int count = bench.worker.active_count;
+    for (uint64_t i = 0; i < iterations; ++i)
+        sum += create_client(&bench.worker, bench.addrs[next_random() % count]);
+    bench.sink = sum;
+}
+
+// look up unknown addresses in the index
+static void bench_lookup_miss(uint64_t iterations) {
+    uint32_t sum = 0;
+    for (uint64_t i = 0; i < iterations; ++i)
+        sum += find_bucket(&bench.worker, &bench.addrs[BENCH_CLIENTS + next_random() % (BENCH_ADDRESSES - BENCH_CLIENTS)]);
+    bench.sink = sum;
+}
+
+// disconnect a random client and connect a new one (a reconnect storm on a nearly full server)
+static void bench_churn(uint64_t iterations) {
+    worker_t *worker = &bench.worker;
+    static uint32_t next = BENCH_CLIENTS;
+    for (uint64_t i = 0; i < iterations; ++i) {
+        destroy_client(worker, worker->active[next_random() % worker->active_count]);
+        create_client(worker, bench.addrs[next++ & (BENCH_ADDRESSES - 1)]);
+    }
+}
+
+// encode a client packet without a baseline
+static void bench_encode_keyframe(uint64_t iterations) {
+    worker_t *worker = &bench.worker;
+    const int slot = worker->active[0];
+    for (uint64_t i = 0; i < iterations; ++i) {
+        worker->sessions[slot].ack_tick = 0;
+        handle_client(worker, slot);
+        reset_packets(worker);
+    }
+}
+
+// encode a client packet with a few changed tiles against the previous frame
+static void bench_encode_delta(uint64_t iterations) {
+    worker_t *worker = &bench.worker;
+    const int slot = worker->active[0];
+    for (uint64_t i = 0; i < iterations; ++i) {
+        worker->sessions[slot].ack_tick = worker->sessions[slot].send_tick;
+        for (int j = 0; j < 4; ++j) {
+            const uint32_t r = next_random();
+            worker->video[slot][r % VIDEO_ROWS][(r >> 8) % VIDEO_COLS] = (uint8_t)(r >> 16);
+        }
+        handle_client(worker, slot);
+        reset_packets(worker);
+    }
+}
+
+// the CPU part of a client tick: expire, game logic, encode (the flush is a syscall and not measured)
+static void bench_tick_sweep(uint64_t iterations) {
+    worker_t *worker = &bench.worker;
+    for (uint64_t i = 0; i < iterations; ++i) {
+        state.tick++;
+        expire_clients(worker);
+        // change a few tiles of every shared screen, like on_tick would
+        for (int j = 0; j < bench.shared; ++j)
+            state.screens.video[j][next_random() % VIDEO_ROWS][next_random() % VIDEO_COLS]++;
+        memcpy(state.screens.history[(state.tick % NETWORK_HISTORY) * state.config.screens], state.screens.video,
+            (size_t)state.config.screens * sizeof(*state.screens.video));
+        run_jobs(worker);
+        for (int j = 0; j < worker->active_count; ++j)
+            worker->clients[worker->active[j]].output.screen = bench.shared ? worker->active[j] % bench.shared : -1;
+        for (int j = 0; j < worker->active_count; ++j) {
+            // acknowledge the previous frame, like a client without packet loss
+            session_t *session = &worker->sessions[worker->active[j]];
+            session->ack_tick = session->send_tick;
+            handle_client(worker, worker->active[j]);
+        }
+        reset_packets(worker);
+    }
+}
+
+
+/*==[[ Init / Shutdown / Main Loop ]]=========================================*/
+
+// run all benchmarks
+static void run_benchmarks(void) {
+    run_bench("uint32_codec", bench_uint32, 1);
+    run_bench("input_codec", bench_input_codec, 1);
+    run_bench("frame_codec", bench_frame_codec, 1);
+    run_bench("codec_fuzz", bench_codec_fuzz, 1);
+    run_bench("delta_fuzz", bench_delta_fuzz, 1);
+    run_bench("hash_address", bench_hash_address, 1);
+    run_bench("same_address", bench_same_address, 1);
+    const int fills[] = { 10, 50, 90 }; // percent of the capacity
+    for (int i = 0; i < (int)(sizeof(fills) / sizeof(fills[0])); ++i) {
+        char name[64];
+        const int percent = fills[i];
+        fill_worker(BENCH_CLIENTS * percent / 100);
+        snprintf(name, sizeof(name), "lookup_hit_%d%%", percent); run_bench(name, bench_lookup_hit, 1);
+        snprintf(name, sizeof(name), "lookup_miss_%d%%", percent); run_bench(name, bench_lookup_miss, 1);
+        snprintf(name, sizeof(name), "churn_%d%%", percent); run_bench(name, bench_churn, 1);
+    }
+    fill_worker(1);
+    run_bench("encode_keyframe", bench_encode_keyframe, 1);
+    run_bench("encode_delta", bench_encode_delta, 1);
+    const int sweeps[] = { 10, 50, 100 }; // percent of the capacity
+    for (int i = 0; i < (int)(sizeof(sweeps) / sizeof(sweeps[0])); ++i) {
+        char name[64];
+        const int count = BENCH_CLIENTS * sweeps[i] / 100;
+        fill_worker(count);
+        snprintf(name, sizeof(name), "tick_sweep_%d%%_per_client", sweeps[i]);
+        run_bench(name, bench_tick_sweep, (uint64_t)count);
+    }
+    // the same crowd on a few shared screens
+    bench.shared = 16;
+    fill_worker(BENCH_CLIENTS);
+    run_bench("tick_sweep_100%_16_screens_per_client", bench_tick_sweep, BENCH_CLIENTS);
+    bench.shared = 0;
+    reset_worker();
+}
+
+// set up a single worker without a socket
+static void init_bench(const char *output) {
+    char *args[] = { "bench", "-c", "4096", "-t", "3600", NULL };
+    parse_config(5, args);
+    state.running = 1;
+    // the logger thread is not started, messages are dropped once its ring is full
+    for (uint32_t i = 0; i < LOG_SLOTS; ++i)
+        state.log.slots[i].sequence = i;
+    worker_t *worker = &bench.worker;
+    worker->udp = -1;
+    worker->family = AF_INET6;
+    layout_worker(worker, allocate_memory(layout_worker(worker, NULL)));
+    init_clients(worker);
+    init_receive(worker);
+    state.screens.video = allocate_memory((size_t)state.config.screens * sizeof(*state.screens.video));
+    state.screens.history = allocate_memory((size_t)state.config.screens * NETWORK_HISTORY * sizeof(*state.screens.history));
+    // random client addresses, all of them distinct (IPv4 and IPv6 mixed, like on a dual-stack socket)
+    if ((bench.addrs = malloc(BENCH_ADDRESSES * sizeof(*bench.addrs))) == NULL)
+        panic("malloc() failed: out of memory");
+    for (int i = 0; i < BENCH_ADDRESSES; ++i) {
+        const uint32_t r = next_random(), host = htonl(0x0A000000u | ((uint32_t)i << 8) | (r >> 24));
+        endpoint_t endpoint;
+        if (i & 1) {
+            endpoint.in6 = (struct sockaddr_in6){ .sin6_family = AF_INET6, .sin6_port = htons(1024 + (r & 0x3FFF)) };
+            endpoint.in6.sin6_addr.s6_addr[0] = 0x20; endpoint.in6.sin6_addr.s6_addr[1] = 0x01;
+            endpoint.in6.sin6_addr.s6_addr[2] = 0x0D; endpoint.in6.sin6_addr.s6_addr[3] = 0xB8;
+            memcpy(&endpoint.in6.sin6_addr.s6_addr[12], &host, sizeof(host));
+        } else {
+            endpoint.in = (struct sockaddr_in){ .sin_family = AF_INET, .sin_port = htons(1024 + (r & 0x3FFF)), .sin_addr.s_addr = host };
+        }
+        bench.addrs[i] = make_address(&endpoint);
+    }
+    if ((bench.output = fopen(output, "w")) == NULL)
+        panic("fopen(%s) failed: %s", output, strerror(errno));
+    fprintf(bench.output, "name,ops,ns_per_op,allocs_per_op\n");
+}
+
+// main entry point
+int main(int argc, char **argv) {
+    init_bench((argc > 1) ? argv[1] : "bench.csv");
+    run_benchmarks();
+    fclose(bench.output);
+    return 0;
+}
+
+
+/*==[[  ]]====================================================================*/
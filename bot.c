@@ -0,0 +1,535 @@
+/*
+================================================================================
+
+    tinyMMO - an attempt to write a simple MMO-RPG in my spare time
+    (headless load generator which simulates many clients)
+    written by Sebastian Steinhauer <s.steinhauer@yahoo.de>
+
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <https://unlicense.org>
+
+================================================================================
+*/
+/*==[[ Includes ]]============================================================*/
+#define _GNU_SOURCE // getaddrinfo() and friends
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include "protocol.h"
+
+
+/*==[[ Defines / Enums ]]======================================================*/
+enum {
+    BOT_CLIENTS                 = 100, // default: virtual clients we simulate
+    BOT_DURATION                = 10, // default: run for 10 seconds
+    BOT_RAMP                    = 0, // default: connect all clients at once
+    BOT_REPORT                  = 1, // print a progress line every second
+
+    TICK_RATE                   = 20, // default: ticks per second of the server (we send input at the same rate)
+
+    NETWORK_PORT                = 6502, // default: UDP port of the server
+    NETWORK_PACKET              = 1024, // size of a single packet buffer
+    NETWORK_HISTORY             = 16, // decoded frames we keep as delta baselines (same as the server)
+    NETWORK_REDUNDANCY          = 4, // previous inputs we repeat in every packet (same as the client)
+
+    STATS_BUCKETS               = 38 * 16, // latency histogram buckets (16 per power of two, up to 2^41 ns)
+};
+
+typedef enum button_t {
+    BUTTON_A                    = 1,
+    BUTTON_B                    = 2,
+    BUTTON_X                    = 4,
+    BUTTON_Y                    = 8,
+    BUTTON_UP                   = 16,
+    BUTTON_DOWN                 = 32,
+    BUTTON_LEFT                 = 64,
+    BUTTON_RIGHT                = 128,
+} button_t;
+
+typedef enum pattern_t {
+    PATTERN_IDLE,               // never press anything
+    PATTERN_WALK,               // hold a direction and change it every second
+    PATTERN_MASH,               // press and release A every tick
+    PATTERN_RANDOM,             // random buttons every tick
+} pattern_t;
+
+
+/*==[[ Types ]]===============================================================*/
+
+// log-linear latency histogram (in nanoseconds, about 6% precision)
+typedef struct histogram_t {
+    uint64_t                    count; // recorded values
+    uint64_t                    max; // largest recorded value
+    uint32_t                    buckets[STATS_BUCKETS]; // value counts
+} histogram_t;
+
+// traffic statistics of all virtual clients
+typedef struct stats_t {
+    uint64_t                    sent; // input packets sent
+    uint64_t                    send_errors; // input packets the kernel refused
+    uint64_t                    challenges; // cookie challenges we answered (one per connect)
+    uint64_t                    received; // frame packets received
+    uint64_t                    bytes; // frame bytes received
+    uint64_t                    keyframes; // frames without a delta baseline
+    uint64_t                    lost; // frame ticks we never saw (gaps in the server tick of a client)
+    uint64_t                    reordered; // frames which arrived after a newer one
+    uint64_t                    errors; // frames we could not decode
+    histogram_t                 jitter; // deviation of the frame interval from the tick time
+    histogram_t                 rtt; // from sending an ack until the first frame based on it (includes waiting for both ticks)
+} stats_t;
+
+// decoded frame of a simulated client
+typedef struct frame_t {
+    uint32_t                    tick; // frame tick (0 = none)
+    double                      acked; // time we first acknowledged this frame (0 = not yet)
+    uint8_t                     video[VIDEO_ROWS][VIDEO_COLS]; // decoded tiles
+} frame_t;
+
+// a single simulated client
+typedef struct bot_t {
+    int                         udp; // own socket, so the server sees an own address
+    double                      start; // time this bot starts sending
+    uint32_t                    send_tick; // our input tick
+    uint8_t                     inputs[NETWORK_REDUNDANCY + 1]; // buttons of this and the previous ticks (newest first)
+    uint32_t                    last_tick; // newest server tick we received (0 = none)
+    double                      last_time; // arrival time of the newest frame
+    uint32_t                    ack_tick; // newest frame we decoded and acknowledge
+    uint32_t                    rtt_tick; // newest baseline we measured the round trip of
+    frame_t                     frames[NETWORK_HISTORY]; // decoded frames by tick
+} bot_t;
+
+
+/*==[[ Global State ]]========================================================*/
+
+static struct state_t {
+    volatile sig_atomic_t       running; // keep running (cleared by SIGINT / SIGTERM)
+    struct {
+        struct sockaddr_storage addr; // server address
+        socklen_t               addr_size; // size of the server address
+        int                     port; // server port
+        int                     clients; // virtual clients
+        int                     tick_rate; // ticks per second
+        double                  tick_time; // seconds per tick
+        int                     duration; // seconds to run
+        int                     ramp; // seconds until all clients are connected
+        pattern_t               pattern; // input pattern
+    } config;
+    bot_t                       *bots; // all virtual clients
+    struct pollfd               *polls; // sockets we wait on
+    stats_t                     stats; // statistics since the start
+    stats_t                     report; // statistics since the last progress line
+} state;
+
+
+/*==[[ Helper Functions ]]====================================================*/
+
+// show error message and quit the bot
+static void panic(const char *fmt, ...) {
+    char message[1024];
+    va_list va;
+    va_start(va, fmt); vsnprintf(message, sizeof(message), fmt, va); va_end(va);
+    fprintf(stderr, "panic: %s\n", message);
+    exit(EXIT_FAILURE);
+}
+
+// return the current monotonic time in seconds
+static double get_time(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1000000000.0;
+}
+
+
+/*==[[ Statistics ]]==========================================================*/
+
+// return the histogram bucket of a value (exact below 16, then 16 sub-buckets per power of two)
+static int histogram_bucket(const uint64_t value) {
+    if (value < 16) return (int)value;
+    const int msb = 63 - __builtin_clzll(value);
+    const int bucket = (msb - 3) * 16 + (int)((value >> (msb - 4)) & 15);
+    return (bucket < STATS_BUCKETS) ? bucket : STATS_BUCKETS - 1;
+}
+
+// return the largest value which falls into a histogram bucket
+static uint64_t histogram_value(const int bucket) {
+    if (bucket < 16) return (uint64_t)bucket;
+    const int msb = bucket / 16 + 3;
+    return ((uint64_t)(16 + bucket % 16 + 1) << (msb - 4)) - 1;
+}
+
+// record a duration (in seconds) in a histogram
+static void histogram_add(histogram_t *histogram, const double seconds) {
+    const uint64_t value = (seconds > 0.0) ? (uint64_t)(seconds * 1e9) : 0;
+    histogram->count++;
+    histogram->buckets[histogram_bucket(value)]++;
+    if (value > histogram->max) histogram->max = value;
+}
+
+// return the value below which the given fraction of all recorded values lies (in milliseconds)
+static double histogram_percentile(const histogram_t *histogram, const double fraction) {
+    const uint64_t rank = (uint64_t)(fraction * (double)histogram->count + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+        if ((seen >= rank) && (seen > 0))
+            return ((histogram_value(i) < histogram->max) ? histogram_value(i) : histogram->max) / 1e6;
+    }
+    return histogram->max / 1e6;
+}
+
+// return the percentage of frames we lost
+static double loss_percent(const stats_t *stats) {
+    const uint64_t expected = stats->received + stats->lost;
+    return expected ? 100.0 * (double)stats->lost / (double)expected : 0.0;
+}
+
+// print a progress line with the statistics since the last one
+static void report_progress(const double elapsed, const int active) {
+    const stats_t *report = &state.report;
+    printf("%6.1fs | %d clients | sent %llu, received %llu (%.1f KiB) | loss %.2f%% | jitter p99 %.3fms | rtt p50 %.3fms p99 %.3fms\n",
+        elapsed, active, (unsigned long long)report->sent, (unsigned long long)report->received, report->bytes / 1024.0,
+        loss_percent(report), histogram_percentile(&report->jitter, 0.99),
+        histogram_percentile(&report->rtt, 0.50), histogram_percentile(&report->rtt, 0.99));
+    fflush(stdout);
+    state.report = (stats_t){0};
+}
+
+// print a histogram summary line
+static void report_histogram(const char *name, const histogram_t *histogram) {
+    printf("  %-8s n=%-10llu p50=%8.3fms p90=%8.3fms p99=%8.3fms max=%8.3fms\n", name, (unsigned long long)histogram->count,
+        histogram_percentile(histogram, 0.50), histogram_percentile(histogram, 0.90),
+        histogram_percentile(histogram, 0.99), histogram->max / 1e6);
+}
+
+// print the summary of the whole run
+static void report_summary(const double elapsed) {
+    const stats_t *stats = &state.stats;
+    int served = 0;
+    for (int i = 0; i < state.config.clients; ++i)
+        if (state.bots[i].last_tick != 0) served++;
+    printf("Summary after %.1fs with %d clients (%d got frames from the server):\n", elapsed, state.config.clients, served);
+    printf("  sent     %llu packets (%llu failed, %llu challenges answered)\n", (unsigned long long)stats->sent,
+        (unsigned long long)stats->send_errors, (unsigned long long)stats->challenges);
+    printf("  received %llu packets (%llu bytes, %.1f bytes per packet, %llu keyframes)\n",
+        (unsigned long long)stats->received, (unsigned long long)stats->bytes,
+        stats->received ? (double)stats->bytes / (double)stats->received : 0.0, (unsigned long long)stats->keyframes);
+    printf("  loss     %.3f%% (%llu frames lost, %llu reordered, %llu undecodable)\n", loss_percent(stats),
+        (unsigned long long)stats->lost, (unsigned long long)stats->reordered, (unsigned long long)stats->errors);
+    report_histogram("jitter", &stats->jitter);
+    report_histogram("rtt", &stats->rtt);
+}
+
+
+/*==[[ Virtual Clients ]]=====================================================*/
+
+// return the buttons a bot holds down during the given tick
+static uint8_t next_buttons(const bot_t *bot, const uint32_t tick) {
+    static const uint8_t directions[4] = { BUTTON_UP, BUTTON_RIGHT, BUTTON_DOWN, BUTTON_LEFT };
+    switch (state.config.pattern) {
+        case PATTERN_WALK: return directions[(tick / state.config.tick_rate + (uint32_t)(bot - state.bots)) % 4];
+        case PATTERN_MASH: return (tick & 1) ? BUTTON_A : 0;
+        case PATTERN_RANDOM: return (uint8_t)rand();
+        default: return 0;
+    }
+}
+
+// send the input of a bot for the next tick, plus the buttons of the previous ticks
+static void send_input(bot_t *bot, const double now) {
+    uint8_t data[PACKET_INPUT_SIZE + NETWORK_REDUNDANCY];
+    const uint32_t tick = ++bot->send_tick;
+    const int count = (tick - 1 < NETWORK_REDUNDANCY) ? (int)tick - 1 : NETWORK_REDUNDANCY;
+    memmove(&bot->inputs[1], &bot->inputs[0], NETWORK_REDUNDANCY);
+    bot->inputs[0] = next_buttons(bot, tick);
+    const input_packet_t input = { .tick = tick, .buttons = bot->inputs[0], .ack = bot->ack_tick, .count = (uint8_t)count };
+    memcpy(encode_input(data, &input), &bot->inputs[1], count);
+    // remember when we first told the server about this frame
+    if (bot->ack_tick != 0) {
+        frame_t *frame = &bot->frames[bot->ack_tick % NETWORK_HISTORY];
+        if ((frame->tick == bot->ack_tick) && (frame->acked == 0.0))
+            frame->acked = now;
+    }
+    if (send(bot->udp, data, PACKET_INPUT_SIZE + count, 0) == (ssize_t)(PACKET_INPUT_SIZE + count)) {
+        state.stats.sent++; state.report.sent++;
+    } else {
+        state.stats.send_errors++; state.report.send_errors++;
+    }
+}
+
+// count a received frame in both statistics
+#define COUNT(field, amount) (state.stats.field += (amount), state.report.field += (amount))
+
+// decode a frame packet from the server
+static void receive_frame(bot_t *bot, const uint8_t *data, const int length, const double now) {
+    frame_packet_t header;
+    const uint8_t *payload = decode_frame(data, length, &header);
+    if (payload == NULL) {
+        COUNT(errors, 1);
+        return;
+    }
+    COUNT(received, 1);
+    COUNT(bytes, (uint64_t)length);
+    const uint32_t tick = header.tick;
+    const uint32_t base = header.base;
+    // the server counts ticks per client, so gaps are lost packets
+    if (tick <= bot->last_tick) {
+        COUNT(reordered, 1);
+        return;
+    }
+    if (bot->last_tick != 0) {
+        COUNT(lost, tick - bot->last_tick - 1);
+        if (tick == bot->last_tick + 1) {
+            const double jitter = (now - bot->last_time) - state.config.tick_time;
+            histogram_add(&state.stats.jitter, (jitter < 0.0) ? -jitter : jitter);
+            histogram_add(&state.report.jitter, (jitter < 0.0) ? -jitter : jitter);
+        }
+    }
+    bot->last_tick = tick;
+    bot->last_time = now;
+    // the first frame built on one of our acks closes the round trip
+    if ((base != 0) && (base > bot->rtt_tick)) {
+        const frame_t *frame = &bot->frames[base % NETWORK_HISTORY];
+        if ((frame->tick == base) && (frame->acked != 0.0)) {
+            histogram_add(&state.stats.rtt, now - frame->acked);
+            histogram_add(&state.report.rtt, now - frame->acked);
+        }
+        bot->rtt_tick = base;
+    }
+    // decode like the real client, so we only acknowledge frames we could build
+    const int payload_length = length - PACKET_FRAME_SIZE;
+    frame_t *frame = &bot->frames[tick % NETWORK_HISTORY];
+    frame->tick = 0;
+    frame->acked = 0.0;
+    if (base == 0) {
+        COUNT(keyframes, 1);
+        if (payload_length != VIDEO_ROWS * VIDEO_COLS) {
+            COUNT(errors, 1);
+            return;
+        }
+        memcpy(frame->video, payload, payload_length);
+    } else {
+        const frame_t *baseline = &bot->frames[base % NETWORK_HISTORY];
+        if ((base >= tick) || (tick - base >= NETWORK_HISTORY) || (baseline->tick != base)) {
+            COUNT(errors, 1);
+            return;
+        }
+        memcpy(frame->video, baseline->video, sizeof(frame->video));
+        if (!decode_delta(frame->video, payload, payload_length)) {
+            COUNT(errors, 1);
+            return;
+        }
+    }
+    frame->tick = tick;
+    bot->ack_tick = tick;
+}
+
+// echo the cookie of a server challenge, the server gives us a slot once it sees it
+static void answer_challenge(bot_t *bot, const uint8_t *data, const int length) {
+    challenge_packet_t challenge;
+    uint8_t answer[PACKET_ANSWER_SIZE];
+    if (decode_challenge(data, length, &challenge) == NULL) {
+        COUNT(errors, 1);
+        return;
+    }
+    COUNT(challenges, 1);
+    encode_answer(answer, &(answer_packet_t){ .cookie = challenge.cookie });
+    if (send(bot->udp, answer, sizeof(answer), 0) != (ssize_t)sizeof(answer))
+        COUNT(send_errors, 1);
+}
+
+// read everything which arrived on the socket of a bot
+static void receive_frames(bot_t *bot, const double now) {
+    uint8_t data[NETWORK_PACKET];
+    for (;;) {
+        const ssize_t received = recv(bot->udp, data, sizeof(data), 0);
+        if (received < 0) return;
+        if (packet_type(data, (int)received) == PACKET_CHALLENGE) {
+            answer_challenge(bot, data, (int)received);
+        } else {
+            receive_frame(bot, data, (int)received, now);
+        }
+    }
+}
+
+// open the socket of a bot and connect it to the server
+static void init_client(bot_t *bot, const int id) {
+    *bot = (bot_t){0};
+    if ((bot->udp = socket(state.config.addr.ss_family, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+        panic("socket() failed: %s (raise the open file limit?)", strerror(errno));
+    if (connect(bot->udp, (const struct sockaddr*)&state.config.addr, state.config.addr_size))
+        panic("connect() failed: %s", strerror(errno));
+    if (fcntl(bot->udp, F_SETFL, O_NONBLOCK, 1))
+        panic("fcntl() failed: %s", strerror(errno));
+    // spread the clients evenly over the ramp up time
+    bot->start = (double)state.config.ramp * (double)id / (double)state.config.clients;
+    state.polls[id] = (struct pollfd){ .fd = bot->udp, .events = POLLIN };
+}
+
+
+/*==[[ Init / Shutdown / Main Loop ]]=========================================*/
+
+// run the load test until the duration is over or we got interrupted
+static void run_bot(void) {
+    const double start = get_time();
+    double next_tick = start, next_report = start + BOT_REPORT;
+    int active = 0;
+    while (state.running) {
+        // send input of every started bot at the tick rate
+        double now = get_time();
+        const double elapsed = now - start;
+        if (elapsed >= state.config.duration) break;
+        if (now >= next_tick) {
+            while ((active < state.config.clients) && (state.bots[active].start <= elapsed))
+                active++;
+            for (int i = 0; i < active; ++i)
+                send_input(&state.bots[i], now);
+            next_tick += state.config.tick_time;
+            if (next_tick < now) next_tick = now + state.config.tick_time; // we fell behind, do not burst
+        }
+        if (now >= next_report) {
+            report_progress(elapsed, active);
+            next_report += BOT_REPORT;
+        }
+        // wait for frames until the next tick
+        const int timeout = (int)((next_tick - now) * 1000.0) + 1;
+        if (poll(state.polls, (nfds_t)active, timeout) <= 0) continue;
+        now = get_time();
+        for (int i = 0; i < active; ++i)
+            if (state.polls[i].revents & POLLIN)
+                receive_frames(&state.bots[i], now);
+    }
+    report_summary(get_time() - start);
+}
+
+// stop the load test
+static void handle_signal(int signal) {
+    (void)signal;
+    state.running = 0;
+}
+
+// show command line usage and quit
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-a server address] [-p port] [-n clients] [-r tick rate] [-d duration secs] [-u ramp up secs] [-m idle|walk|mash|random]\n", program);
+    fprintf(stderr, "defaults: -a 127.0.0.1 -p %d -n %d -r %d -d %d -u %d -m walk\n", NETWORK_PORT, BOT_CLIENTS, TICK_RATE, BOT_DURATION, BOT_RAMP);
+    exit(EXIT_FAILURE);
+}
+
+// parse a numeric command line option within the given limits
+static int parse_option(const char *program, const char *arg, const int min, const int max) {
+    char *end;
+    const long x = strtol(arg, &end, 10);
+    if ((*arg == '\0') || (*end != '\0') || (x < min) || (x > max))
+        usage(program);
+    return (int)x;
+}
+
+// read the configuration from the command line
+static void parse_config(int argc, char **argv) {
+    const char *host = "127.0.0.1";
+    int port = NETWORK_PORT;
+    state.config.clients = BOT_CLIENTS;
+    state.config.tick_rate = TICK_RATE;
+    state.config.duration = BOT_DURATION;
+    state.config.ramp = BOT_RAMP;
+    state.config.pattern = PATTERN_WALK;
+    for (int option; (option = getopt(argc, argv, "a:p:n:r:d:u:m:h")) != -1;) {
+        switch (option) {
+            case 'a': host = optarg; break;
+            case 'p': port = parse_option(argv[0], optarg, 1, 65535); break;
+            case 'n': state.config.clients = parse_option(argv[0], optarg, 1, 1 << 20); break;
+            case 'r': state.config.tick_rate = parse_option(argv[0], optarg, 1, 1000); break;
+            case 'd': state.config.duration = parse_option(argv[0], optarg, 1, 86400); break;
+            case 'u': state.config.ramp = parse_option(argv[0], optarg, 0, 86400); break;
+            case 'm':
+                if (!strcmp(optarg, "idle")) state.config.pattern = PATTERN_IDLE;
+                else if (!strcmp(optarg, "walk")) state.config.pattern = PATTERN_WALK;
+                else if (!strcmp(optarg, "mash")) state.config.pattern = PATTERN_MASH;
+                else if (!strcmp(optarg, "random")) state.config.pattern = PATTERN_RANDOM;
+                else usage(argv[0]);
+                break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc)
+        usage(argv[0]);
+    state.config.port = port;
+    state.config.tick_time = 1.0 / (double)state.config.tick_rate;
+    // resolve the server address
+    char service[16];
+    snprintf(service, sizeof(service), "%d", port);
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM }, *result;
+    const int error = getaddrinfo(host, service, &hints, &result);
+    if (error)
+        panic("getaddrinfo(%s) failed: %s", host, gai_strerror(error));
+    memcpy(&state.config.addr, result->ai_addr, result->ai_addrlen);
+    state.config.addr_size = result->ai_addrlen;
+    freeaddrinfo(result);
+}
+
+// initialize the load test
+static void init_bot(int argc, char **argv) {
+    state.running = 1;
+    parse_config(argc, argv);
+    // every virtual client needs its own socket
+    struct rlimit limit;
+    if (!getrlimit(RLIMIT_NOFILE, &limit) && (limit.rlim_cur < (rlim_t)state.config.clients + 16)) {
+        limit.rlim_cur = (limit.rlim_max < (rlim_t)state.config.clients + 16) ? limit.rlim_max : (rlim_t)state.config.clients + 16;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    if (((state.bots = calloc(state.config.clients, sizeof(bot_t))) == NULL) ||
+        ((state.polls = calloc(state.config.clients, sizeof(struct pollfd))) == NULL))
+        panic("calloc() failed: out of memory");
+    for (int i = 0; i < state.config.clients; ++i)
+        init_client(&state.bots[i], i);
+    srand((unsigned)time(NULL));
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    printf("Simulating %d clients against port %d (%d ticks per second, %d seconds, ramp up %d seconds) ...\n", state.config.clients,
+        state.config.port, state.config.tick_rate, state.config.duration, state.config.ramp);
+}
+
+// main entry point
+int main(int argc, char **argv) {
+    init_bot(argc, argv);
+    run_bot();
+    return 0;
+}
+
+
+/*==[[  ]]====================================================================*/
@@ -32,28 +32,69 @@
 ================================================================================
 */
 /*==[[ Includes ]]============================================================*/
+#define _POSIX_C_SOURCE 200112L // getaddrinfo() and friends
+
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "SDL.h"
+#include "protocol.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 
 /*==[[ Defines / Enums ]]======================================================*/
 enum {
     TICK_RATE                   = 20, // 20 ticks per second
 
-    VIDEO_COLS                  = 16, // tile columns
-    VIDEO_ROWS                  = 16, // tile rows
+    VIDEO_FPS                   = 60, // present at most 60 frames per second unless told otherwise
+    CAPTURE_SLOTS               = 16, // screenshots which can wait for the capture thread (power of two)
     TILE_SIZE                   = 8, // tile size (8x8 pixels)
+    TILESET_SIZE                = 16 * TILE_SIZE, // tileset width and height (16x16 tiles)
+
+    BUNDLE_VERSION              = 1, // asset bundle layout (also tells us whether it has our byte order)
+    BUNDLE_ALIGN                = 16, // alignment of the assets in the bundle
 
     AUDIO_RATE                  = 8000, // we mix audio at 8KHz
     AUDIO_VOICES                = 8, // we support 8 concurrent sounds
     AUDIO_SOUNDS                = 32, // we have 32 sound effects
     AUDIO_TRACKS                = 8, // we have 8 music tracks
+    AUDIO_BLOCK                 = 1024, // samples we mix at once (multiple of 8)
+    AUDIO_COMMANDS              = 256, // commands which can wait for the mixer (power of two)
+    AUDIO_STREAM                = 1 << 15, // samples of streamed music we buffer per track (4s, power of two)
+    AUDIO_CHUNK                 = 4096, // samples the music loader reads at once
+    AUDIO_LOADER_WAIT           = 50, // the music loader checks its buffers every 50ms
+
+    NETWORK_HISTORY             = 16, // decoded frames we keep as delta baselines (and jitter buffer)
+    NETWORK_PACKET              = 1024, // size of the receive buffer
+    NETWORK_DELAY               = 2, // ticks we keep buffered before presenting a frame
+    NETWORK_REDUNDANCY          = 4, // previous inputs we repeat in every packet (lost packets lose no button presses)
+    NETWORK_TIMEOUT             = 2 * TICK_RATE, // reconnect after 2s without frames
 };
 
+#define NETWORK_HOST            "127.0.0.1"
+#define NETWORK_PORT            "6502"
+
+#define BUNDLE_FILE             "assets.pak"
+#define BUNDLE_MAGIC            "TPAK"
+
 #define VIDEO_TITLE             "tinyMMO - Client"
 #define VIDEO_FACTOR            0.8f
 
@@ -74,19 +115,59 @@ typedef enum {
 
 /*==[[ Types ]]===============================================================*/
 
-// sound effect / music asset
+// header of the asset bundle (everything in native byte order, offsets from the start of the file)
+typedef struct bundle_t {
+    char                        magic[4]; // BUNDLE_MAGIC
+    uint32_t                    version; // BUNDLE_VERSION
+    uint32_t                    size; // size of the whole bundle
+    uint32_t                    tiles; // tileset pixels (TILESET_SIZE x TILESET_SIZE, ARGB8888)
+    struct {
+        uint32_t                offset; // PCM data (AUDIO_S16SYS, mono, AUDIO_RATE)
+        uint32_t                length; // length in PCM samples (0 = no sound)
+    }                           sounds[AUDIO_SOUNDS]; // sound effects
+} bundle_t;
+
+// sound effect asset
 typedef struct sound_t {
-    int16_t                     *data; // 16-bit PCM data
+    const int16_t               *data; // 16-bit PCM data
     int                         length; // length in PCM samples
 } sound_t;
 
+// music track streamed from disk by the loader thread
+typedef struct stream_t {
+    int16_t                     ring[AUDIO_STREAM]; // sample ring
+    SDL_atomic_t                write; // samples the loader wrote
+    SDL_atomic_t                read; // samples the mixer consumed
+    SDL_atomic_t                request; // the game thread increases this to ask for track
+    SDL_atomic_t                loaded; // request the loader prepared (ring reset and filled)
+    int                         track; // music track to stream (-1 = none, written before request)
+    // owned by the loader thread
+    SDL_RWops                   *file; // open WAV file (NULL = none)
+    Sint64                      data_start; // file offset of the PCM data
+    Uint32                      data_length; // size of the PCM data in bytes
+    Uint32                      position; // bytes of PCM data we read so far
+} stream_t;
+
 // sound / music playback channel
 typedef struct voice_t {
+    stream_t                    *stream; // streamed music played instead of a sound
     sound_t                     *sound; // which sound is currently played
     int                         position; // current playback position
     bool                        loop; // shall we loop?
 } voice_t;
 
+// command from the game thread to the mixer
+typedef struct audio_command_t {
+    enum {
+        AUDIO_PLAY_SOUND,       // start sound on a free voice
+        AUDIO_PLAY_MUSIC,       // replace the music stream on voice 0 (NULL = silence)
+        AUDIO_SET_GAIN,         // change the global volume
+    }                           type; // what to do
+    sound_t                     *sound; // sound to play
+    stream_t                    *stream; // music to play (NULL = silence)
+    float                       gain; // new global volume
+} audio_command_t;
+
 
 /*==[[ Global State ]]========================================================*/
 
@@ -101,23 +182,85 @@ static struct state_t {
         uint8_t                 down; // bit-mask of pressed buttons
     } input;
 
+    // asset bundle
+    struct {
+        const uint8_t           *data; // memory mapped bundle (NULL = none)
+        size_t                  size; // size of the mapping
+    } bundle;
+
     // video system
     struct {
         SDL_Window              *window; // SDL2 window handle
         SDL_Renderer            *renderer; // SDL2 renderer handle
-        SDL_Texture             *texture; // SDL2 texture handle
+        SDL_Texture             *texture; // streaming texture holding the whole tilemap
+        const uint32_t          *tiles; // tileset pixels in the bundle (CPU side tile atlas)
         uint8_t                 screen[VIDEO_ROWS][VIDEO_COLS]; // tilemap
+        uint8_t                 shown[VIDEO_ROWS][VIDEO_COLS]; // tilemap composed into pixels
+        uint32_t                pixels[VIDEO_ROWS * TILE_SIZE][VIDEO_COLS * TILE_SIZE]; // composed tilemap
+        bool                    dirty; // screen changed since we composed it
+        bool                    redraw; // window needs to be presented again
+        double                  frame_time; // minimum time between two presents in ms (0 = no limit)
     } video;
 
+    // screenshot capture
+    struct {
+        struct {
+            char                filename[64]; // where the capture thread writes the screenshot
+            uint32_t            pixels[VIDEO_ROWS * TILE_SIZE][VIDEO_COLS * TILE_SIZE]; // copy of the composed tilemap
+        } slots[CAPTURE_SLOTS]; // screenshot ring (single producer, single consumer)
+        SDL_atomic_t            head; // next slot the game thread fills
+        SDL_atomic_t            tail; // next slot the capture thread writes
+        SDL_Thread              *thread; // capture thread
+        SDL_sem                 *wake; // wakes the capture thread up
+        SDL_atomic_t            running; // cleared to stop the capture thread (after it wrote everything)
+        long                    session; // start time of the client, keeps file names unique across runs
+        unsigned                screenshots; // screenshots taken so far
+        bool                    recording; // capture every tick
+        unsigned                sequence; // recordings made so far
+        unsigned                frames; // frames of the current recording
+        unsigned                dropped; // frames of the current recording the capture thread had no room for
+    } capture;
+
     // audio system
     struct {
         SDL_AudioDeviceID       device; // SDL2 audio device handle
         float                   gain; // global audio volume
-        voice_t                 voices[AUDIO_VOICES]; // our audio voices
         sound_t                 sounds[AUDIO_SOUNDS]; // our sound effects
-        sound_t                 music; // current music track
-        int                     music_id;
+        stream_t                streams[2]; // music streams (one plays, the other one is free once the mixer let go of it)
+        int                     stream; // stream which plays
+        unsigned                retired; // command position after which the mixer no longer uses the other stream
+        int                     music_id; // music track which plays
+        int                     music_next; // music track the other stream gets prepared for (-1 = none)
+        SDL_Thread              *loader; // music loader thread
+        SDL_sem                 *loader_wake; // wakes the loader up early
+        SDL_atomic_t            loader_running; // cleared to stop the loader
+        // commands from the game thread to the mixer (single producer, single consumer)
+        struct {
+            audio_command_t     commands[AUDIO_COMMANDS]; // command ring
+            SDL_atomic_t        head; // next command the game thread writes
+            SDL_atomic_t        tail; // next command the mixer reads
+        } queue;
+        // owned by the mixer (audio callback)
+        voice_t                 voices[AUDIO_VOICES]; // our audio voices
+        float                   mixer_gain; // global audio volume the mixer uses
+        int32_t                 mix[AUDIO_BLOCK]; // mixing buffer
     } audio;
+
+    // network system
+    struct {
+        int                     udp; // UDP socket connected to the server (-1 = none)
+        uint32_t                ack_tick; // newest server tick we decoded (sent back as acknowledgement)
+        uint32_t                play_tick; // server tick we presented last (0 = nothing yet)
+        uint32_t                silence; // client ticks since the last new frame
+        uint8_t                 inputs[NETWORK_REDUNDANCY]; // buttons of the previous ticks (newest first)
+        struct {
+            uint32_t            tick; // server tick of this frame (0 = unused)
+            uint32_t            audio; // sound effects started in this frame
+            int8_t              music; // music track of this frame
+            uint8_t             video[VIDEO_ROWS][VIDEO_COLS]; // decoded tilemap
+        } frames[NETWORK_HISTORY]; // decoded frames, indexed by server tick
+        uint8_t                 screen[VIDEO_ROWS][VIDEO_COLS]; // tilemap of the presented frame
+    } net;
 } state;
 
 
@@ -128,18 +271,11 @@ static void panic(const char *fmt, ...) {
     char message[1024];
     va_list va;
     va_start(va, fmt); SDL_vsnprintf(message, sizeof(message), fmt, va); va_end(va);
+    SDL_LogError(SDL_LOG_CATEGORY_APPLICATION, "%s", message);
     SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Panic!", message, state.video.window);
     exit(EXIT_FAILURE);
 }
 
-// format given string
-static const char *format_string(const char *fmt, ...) {
-    static char text[1024];
-    va_list va;
-    va_start(va, fmt); SDL_vsnprintf(text, sizeof(text), fmt, va); va_end(va);
-    return text;
-}
-
 // clamp integer value
 static int clampi(const int x, const int min, const int max) {
     if (x < min) return min; else if (x > max) return max; else return x;
@@ -156,12 +292,21 @@ static float clampf(const float x, const float min, const float max) {
 // clear the screen
 static void clear_screen(void) {
     SDL_zero(state.video.screen);
+    state.video.dirty = true;
 }
 
 // draw tile
 static void draw_tile(const int x, const int y, const uint8_t tile) {
-    if ((x >= 0) && (x < VIDEO_COLS) && (y >= 0) && (y < VIDEO_ROWS))
+    if ((x >= 0) && (x < VIDEO_COLS) && (y >= 0) && (y < VIDEO_ROWS) && (state.video.screen[y][x] != tile)) {
         state.video.screen[y][x] = tile;
+        state.video.dirty = true;
+    }
+}
+
+// replace the whole tilemap
+static void copy_screen(const uint8_t screen[VIDEO_ROWS][VIDEO_COLS]) {
+    SDL_memcpy(state.video.screen, screen, sizeof(state.video.screen));
+    state.video.dirty = true;
 }
 
 // draw text
@@ -170,6 +315,23 @@ static void draw_text(const int x, const int y, const char *text) {
         draw_tile(xx, y, (uint8_t)*text);
 }
 
+// copy the tiles which changed (or all of them) from the tileset into pixels, returns the number of copied tiles
+static int compose_video(const bool all) {
+    int count = 0;
+    for (int y = 0; y < VIDEO_ROWS; ++y) {
+        for (int x = 0; x < VIDEO_COLS; ++x) {
+            const uint8_t tile = state.video.screen[y][x];
+            if (!all && (state.video.shown[y][x] == tile)) continue;
+            state.video.shown[y][x] = tile;
+            const uint32_t *src = &state.video.tiles[(tile / 16) * TILE_SIZE * TILESET_SIZE + (tile % 16) * TILE_SIZE];
+            for (int i = 0; i < TILE_SIZE; ++i, src += TILESET_SIZE)
+                SDL_memcpy(&state.video.pixels[y * TILE_SIZE + i][x * TILE_SIZE], src, TILE_SIZE * sizeof(uint32_t));
+            ++count;
+        }
+    }
+    return count;
+}
+
 // toggle fullscreen
 static void toggle_fullscreen(void) {
     uint32_t flags = SDL_GetWindowFlags(state.video.window);
@@ -180,61 +342,153 @@ static void toggle_fullscreen(void) {
     }
 }
 
-// take a screenshot (this is for documentation only)
-void debug_screenshot(void) {
-    int w, h, bpp;
-    SDL_GetRendererOutputSize(state.video.renderer, &w, &h);
-    uint32_t pixel_format = SDL_GetWindowPixelFormat(state.video.window);
-    uint32_t rmask, gmask, bmask, amask;
-    SDL_PixelFormatEnumToMasks(pixel_format, &bpp, &rmask, &gmask, &bmask, &amask);
-    SDL_Surface *surface = SDL_CreateRGBSurface(0, w, h, bpp, rmask, gmask, bmask, amask);
-    SDL_RenderReadPixels(state.video.renderer, NULL, pixel_format, surface->pixels, surface->pitch);
-    SDL_SaveBMP(surface, "screenshot.bmp");
-    SDL_FreeSurface(surface);
+// write all queued screenshots to disk (runs on its own thread, so captures never stall a frame)
+static int run_capture(void *data) {
+    (void)data;
+    for (;;) {
+        const unsigned tail = (unsigned)SDL_AtomicGet(&state.capture.tail);
+        if (tail == (unsigned)SDL_AtomicGet(&state.capture.head)) {
+            if (!SDL_AtomicGet(&state.capture.running)) break;
+            SDL_SemWait(state.capture.wake);
+            continue;
+        }
+        const int n = tail & (CAPTURE_SLOTS - 1);
+        SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormatFrom(state.capture.slots[n].pixels, VIDEO_COLS * TILE_SIZE, VIDEO_ROWS * TILE_SIZE,
+            32, sizeof(state.capture.slots[n].pixels[0]), SDL_PIXELFORMAT_ARGB8888);
+        if ((surface == NULL) || SDL_SaveBMP(surface, state.capture.slots[n].filename))
+            SDL_Log("Cannot write screenshot (%s): %s", state.capture.slots[n].filename, SDL_GetError());
+        SDL_FreeSurface(surface);
+        SDL_AtomicAdd(&state.capture.tail, 1); // full barrier, we are done with the slot before the game thread reuses it
+    }
+    return 0;
+}
+
+// queue a copy of the tilemap as shown for the capture thread, returns false when it is too far behind
+static bool capture_frame(const char *fmt, ...) {
+    const unsigned head = (unsigned)SDL_AtomicGet(&state.capture.head);
+    if (head - (unsigned)SDL_AtomicGet(&state.capture.tail) >= CAPTURE_SLOTS)
+        return false;
+    if (compose_video(false)) state.video.redraw = true;
+    const int n = head & (CAPTURE_SLOTS - 1);
+    va_list va;
+    va_start(va, fmt); SDL_vsnprintf(state.capture.slots[n].filename, sizeof(state.capture.slots[n].filename), fmt, va); va_end(va);
+    SDL_memcpy(state.capture.slots[n].pixels, state.video.pixels, sizeof(state.video.pixels));
+    SDL_AtomicAdd(&state.capture.head, 1); // full barrier, the slot is visible before the new head
+    SDL_SemPost(state.capture.wake);
+    return true;
+}
+
+// take a screenshot (written in the background)
+static void take_screenshot(void) {
+    if (capture_frame("screenshot-%ld-%03u.bmp", state.capture.session, state.capture.screenshots))
+        ++state.capture.screenshots;
+    else
+        SDL_Log("Screenshot dropped, the capture thread is too far behind");
+}
+
+// start or stop recording a screenshot on every tick
+static void toggle_recording(void) {
+    if ((state.capture.recording = !state.capture.recording)) {
+        state.capture.frames = state.capture.dropped = 0;
+    } else {
+        SDL_Log("Recorded %u frames (%u dropped)", state.capture.frames, state.capture.dropped);
+        ++state.capture.sequence;
+    }
+}
+
+// add the current tick to the recording
+static void record_frame(void) {
+    if (!state.capture.recording)
+        return;
+    if (capture_frame("record-%ld-%02u-%05u.bmp", state.capture.session, state.capture.sequence, state.capture.frames))
+        ++state.capture.frames;
+    else
+        ++state.capture.dropped;
 }
 
 /*==[[ Audio Functions ]]=====================================================*/
 
-// stop all audio output
+// hand a command to the mixer, returns false when the mixer is too far behind
+static bool push_audio(const audio_command_t command) {
+    const unsigned head = (unsigned)SDL_AtomicGet(&state.audio.queue.head);
+    if (head - (unsigned)SDL_AtomicGet(&state.audio.queue.tail) >= AUDIO_COMMANDS)
+        return false;
+    state.audio.queue.commands[head & (AUDIO_COMMANDS - 1)] = command;
+    SDL_AtomicAdd(&state.audio.queue.head, 1); // full barrier, the command is visible before the new head
+    return true;
+}
+
+// run all commands the game thread queued for the mixer
+static void drain_audio(void) {
+    const unsigned head = (unsigned)SDL_AtomicGet(&state.audio.queue.head);
+    for (unsigned tail = (unsigned)SDL_AtomicGet(&state.audio.queue.tail); tail != head; ++tail) {
+        const audio_command_t *command = &state.audio.queue.commands[tail & (AUDIO_COMMANDS - 1)];
+        switch (command->type) {
+            case AUDIO_PLAY_SOUND:
+                // find free audio voice to play this effect
+                for (int i = 1; i < AUDIO_VOICES; ++i) {
+                    if (state.audio.voices[i].sound == NULL) {
+                        state.audio.voices[i] = (voice_t){ .sound = command->sound };
+                        break;
+                    }
+                }
+                break;
+            case AUDIO_PLAY_MUSIC: state.audio.voices[0] = (voice_t){ .stream = command->stream }; break;
+            case AUDIO_SET_GAIN: state.audio.mixer_gain = command->gain; break;
+        }
+        SDL_AtomicAdd(&state.audio.queue.tail, 1);
+    }
+}
+
+// stop all audio output and wait until the mixer let go of every sound (the only place which locks the device)
 static void stop_audio(void) {
     SDL_LockAudioDevice(state.audio.device);
+    drain_audio();
     for (int i = 0; i < AUDIO_VOICES; ++i)
         state.audio.voices[i] = (voice_t){0};
     SDL_UnlockAudioDevice(state.audio.device);
+    state.audio.retired = (unsigned)SDL_AtomicGet(&state.audio.queue.head);
 }
 
 // adjust global audio volume
 static void adjust_gain(const float delta) {
-    SDL_LockAudioDevice(state.audio.device);
     state.audio.gain = clampf(state.audio.gain + delta, 0.0f, 1.0f);
-    SDL_UnlockAudioDevice(state.audio.device);
+    push_audio((audio_command_t){ .type = AUDIO_SET_GAIN, .gain = state.audio.gain });
 }
 
-// forward declaration of sound loading
-static void load_sound(sound_t *sound, const char *filename);
-
-// play music
+// play music (never blocks, the old track keeps playing until the loader prepared the new one)
 static void play_music(const int n) {
     // make sure we skip everything when we are currently playing the same music
     if (n == state.audio.music_id)
         return;
-    state.audio.music_id = n;
-    // stop music playback on voice 0
-    SDL_LockAudioDevice(state.audio.device);
-    state.audio.voices[0] = (voice_t){0};
-    SDL_UnlockAudioDevice(state.audio.device);
-    // free previous loaded audio track
-    if (state.audio.music.data != NULL) {
-        SDL_FreeWAV((Uint8*)state.audio.music.data);
-        state.audio.music = (sound_t){0};
+    if (n < 0) {
+        if (push_audio((audio_command_t){ .type = AUDIO_PLAY_MUSIC, .stream = NULL })) {
+            state.audio.music_id = -1;
+            state.audio.music_next = -1;
+        }
+        return;
     }
-    // load music track (if possible)
-    load_sound(&state.audio.music, format_string("assets/music%02d.wav", n));
-    if (state.audio.music.data != NULL) {
-        SDL_LockAudioDevice(state.audio.device);
-        state.audio.voices[0] = (voice_t){ .sound = &state.audio.music, .loop = true };
-        SDL_UnlockAudioDevice(state.audio.device);
+    stream_t *stream = &state.audio.streams[state.audio.stream ^ 1];
+    if (n != state.audio.music_next) {
+        // wait until the mixer let go of the other stream, then ask the loader for the track
+        if ((int)((unsigned)SDL_AtomicGet(&state.audio.queue.tail) - state.audio.retired) < 0)
+            return;
+        stream->track = n;
+        SDL_AtomicAdd(&stream->request, 1); // full barrier, the loader sees the track before the request
+        SDL_SemPost(state.audio.loader_wake);
+        state.audio.music_next = n;
+        return;
     }
+    // switch over once the start of the track is buffered
+    if (SDL_AtomicGet(&stream->loaded) != SDL_AtomicGet(&stream->request))
+        return;
+    if (!push_audio((audio_command_t){ .type = AUDIO_PLAY_MUSIC, .stream = stream }))
+        return;
+    // the mixer lets go of the old stream once it ran this command
+    state.audio.music_id = n;
+    state.audio.music_next = -1;
+    state.audio.stream ^= 1;
+    state.audio.retired = (unsigned)SDL_AtomicGet(&state.audio.queue.head);
 }
 
 // play sound effect
@@ -242,117 +496,267 @@ static void play_sound(const int n) {
     // make sure the sound effect exists
     if ((n < 0) || (n >= AUDIO_SOUNDS) || (state.audio.sounds[n].data == NULL))
         return;
-    // find free audio voice to play this effect
-    SDL_LockAudioDevice(state.audio.device);
-    for (int i = 1; i < AUDIO_VOICES; ++i) {
-        if (state.audio.voices[i].sound == NULL) {
-            state.audio.voices[i] = (voice_t){ .sound = &state.audio.sounds[n] };
-            break;
-        }
-    }
-    SDL_UnlockAudioDevice(state.audio.device);
+    push_audio((audio_command_t){ .type = AUDIO_PLAY_SOUND, .sound = &state.audio.sounds[n] });
 }
 
 
 /*==[[ Asset Handling ]]======================================================*/
 
-// load tileset
-static SDL_Texture *load_tileset(const char *filename) {
-    SDL_Surface *surface = SDL_LoadBMP(filename);
-    if (surface == NULL)
-        panic("SDL_LoadBMP() failed: %s", SDL_GetError());
-    if ((surface->w != 16 * TILE_SIZE) || (surface->h != 16 * TILE_SIZE)) {
-        SDL_FreeSurface(surface);
-        panic("Tileset image has wrong size");
+// open a music track and reset its stream (only while the mixer does not use it)
+static void open_stream(stream_t *stream, const int track) {
+    if (stream->file != NULL) {
+        SDL_RWclose(stream->file);
+        stream->file = NULL;
+    }
+    SDL_AtomicSet(&stream->write, 0);
+    SDL_AtomicSet(&stream->read, 0);
+    char filename[64];
+    SDL_snprintf(filename, sizeof(filename), "assets/music%02d.wav", track);
+    if ((track < 0) || ((stream->file = SDL_RWFromFile(filename, "rb")) == NULL))
+        return;
+    // walk the RIFF chunks up to the PCM data
+    Uint8 riff[12];
+    if ((SDL_RWread(stream->file, riff, sizeof(riff), 1) != 1) || SDL_memcmp(riff, "RIFF", 4) || SDL_memcmp(&riff[8], "WAVE", 4))
+        panic("Music (%s) is not a WAV file", filename);
+    for (bool format = false;;) {
+        Uint8 id[4];
+        if (SDL_RWread(stream->file, id, sizeof(id), 1) != 1)
+            panic("Music (%s) has no PCM data", filename);
+        const Uint32 size = SDL_ReadLE32(stream->file);
+        if (!SDL_memcmp(id, "fmt ", 4)) {
+            const Uint16 encoding = SDL_ReadLE16(stream->file), channels = SDL_ReadLE16(stream->file);
+            const Uint32 rate = SDL_ReadLE32(stream->file);
+            SDL_RWseek(stream->file, 6, RW_SEEK_CUR);
+            const Uint16 bits = SDL_ReadLE16(stream->file);
+            if ((encoding != 1) || (channels != 1) || (rate != AUDIO_RATE) || (bits != 16))
+                panic("Music (%s) is not 16-bit PCM mono 8KHz", filename);
+            SDL_RWseek(stream->file, (Sint64)size - 16 + (size & 1), RW_SEEK_CUR);
+            format = true;
+        } else if (!SDL_memcmp(id, "data", 4) && format) {
+            stream->data_start = SDL_RWtell(stream->file);
+            stream->data_length = size & ~1u;
+            stream->position = 0;
+            return;
+        } else {
+            SDL_RWseek(stream->file, (Sint64)size + (size & 1), RW_SEEK_CUR);
+        }
     }
-    SDL_Texture *texture = SDL_CreateTextureFromSurface(state.video.renderer, surface);
-    SDL_FreeSurface(surface);
-    if (texture == NULL)
-        panic("SDL_CreateTextureFromSurface() failed: %s", SDL_GetError());
-    return texture;
 }
 
-// load sound effect / music track
-static void load_sound(sound_t *sound, const char *filename) {
-    SDL_AudioSpec spec;
-    Uint8 *sample_data;
-    Uint32 sample_length;
-    if (SDL_LoadWAV(filename, &spec, &sample_data, &sample_length) == NULL)
-        return;
-    if ((spec.format != AUDIO_S16SYS) || (spec.channels != 1) || (spec.freq != AUDIO_RATE)) {
-        SDL_FreeWAV(sample_data);
-        panic("Sound (%s) is not 16-bit PCM mono 8KHz");
+// read as much music as fits into the ring of a stream (loops at the end of the track)
+static void fill_stream(stream_t *stream) {
+    while (stream->file != NULL) {
+        const unsigned write = (unsigned)SDL_AtomicGet(&stream->write);
+        const unsigned read = (unsigned)SDL_AtomicGet(&stream->read);
+        if (AUDIO_STREAM - (write - read) < AUDIO_CHUNK)
+            return;
+        if (stream->position >= stream->data_length) {
+            if ((stream->data_length == 0) || (SDL_RWseek(stream->file, stream->data_start, RW_SEEK_SET) < 0)) {
+                SDL_RWclose(stream->file);
+                stream->file = NULL;
+                return;
+            }
+            stream->position = 0;
+        }
+        // read a chunk into the contiguous part of the ring
+        const unsigned offset = write & (AUDIO_STREAM - 1);
+        size_t count = SDL_min(AUDIO_CHUNK, AUDIO_STREAM - offset);
+        count = SDL_min(count, (stream->data_length - stream->position) / 2);
+        count = SDL_RWread(stream->file, &stream->ring[offset], 2, count);
+        if ((count == 0) && (stream->position == 0)) {
+            // nothing right behind the header, a truncated track stops instead of rewinding forever
+            SDL_RWclose(stream->file);
+            stream->file = NULL;
+            return;
+        } else if (count == 0) {
+            stream->position = stream->data_length;
+            continue;
+        }
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+        for (size_t i = 0; i < count; ++i)
+            stream->ring[offset + i] = (int16_t)SDL_SwapLE16((Uint16)stream->ring[offset + i]);
+#endif
+        stream->position += (Uint32)count * 2;
+        SDL_AtomicAdd(&stream->write, (int)count); // full barrier, the samples are visible before the counter
     }
-    *sound = (sound_t){ .data = (int16_t*)sample_data, .length = sample_length / 2 };
+}
+
+// music loader thread, prepares requested tracks and keeps all streams filled
+static int run_loader(void *data) {
+    (void)data;
+    while (SDL_AtomicGet(&state.audio.loader_running)) {
+        for (int i = 0; i < 2; ++i) {
+            stream_t *stream = &state.audio.streams[i];
+            const int request = SDL_AtomicGet(&stream->request);
+            if (request != SDL_AtomicGet(&stream->loaded)) {
+                open_stream(stream, stream->track);
+                fill_stream(stream);
+                SDL_AtomicSet(&stream->loaded, request);
+            } else {
+                fill_stream(stream);
+            }
+        }
+        SDL_SemWaitTimeout(state.audio.loader_wake, AUDIO_LOADER_WAIT);
+    }
+    for (int i = 0; i < 2; ++i)
+        if (state.audio.streams[i].file != NULL) SDL_RWclose(state.audio.streams[i].file);
+    return 0;
 }
 
 // free all assets
 static void free_assets(void) {
     stop_audio();
-    // free tileset
-    if (state.video.texture != NULL) {
-        SDL_DestroyTexture(state.video.texture);
-        state.video.texture = NULL;
-    }
-    // free sounds
-    for (int i = 0; i < AUDIO_SOUNDS; ++i) {
-        if (state.audio.sounds[i].data != NULL) {
-            SDL_FreeWAV((Uint8*)state.audio.sounds[i].data);
-            state.audio.sounds[i] = (sound_t){0};
-        }
-    }
-    // free music
-    if (state.audio.music.data != NULL) {
-        SDL_FreeWAV((Uint8*)state.audio.music.data);
-        state.audio.music = (sound_t){0};
+    // the tileset and sounds live in the bundle
+    state.video.tiles = NULL;
+    SDL_zero(state.audio.sounds);
+    if (state.bundle.data != NULL) {
+        munmap((void*)state.bundle.data, state.bundle.size);
+        state.bundle.data = NULL;
     }
+    // music starts again with the next frame from the server
+    state.audio.music_id = -1;
+    state.audio.music_next = -1;
 }
 
-// load all assets
+// check that an asset lies completely inside the bundle
+static bool check_asset(const uint32_t offset, const uint32_t size) {
+    return (offset % BUNDLE_ALIGN == 0) && (offset <= state.bundle.size) && (size <= state.bundle.size - offset);
+}
+
+// map the asset bundle, the tileset and sounds point straight into it
 static void load_assets(void) {
     free_assets();
-    state.video.texture = load_tileset("assets/tiles.bmp");
-    for (int i = 0; i < AUDIO_SOUNDS; ++i)
-        load_sound(&state.audio.sounds[i], format_string("assets/sound%02d.wav", i));
+    const int fd = open(BUNDLE_FILE, O_RDONLY);
+    if (fd == -1)
+        panic("Cannot open asset bundle (%s): %s, build it with \"make assets\"", BUNDLE_FILE, strerror(errno));
+    struct stat st;
+    if (fstat(fd, &st))
+        panic("fstat(%s) failed: %s", BUNDLE_FILE, strerror(errno));
+    if ((st.st_size < (off_t)sizeof(bundle_t)) || (st.st_size > UINT32_MAX))
+        panic("Asset bundle (%s) is broken or was built for another client", BUNDLE_FILE);
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        panic("Cannot map asset bundle (%s): %s", BUNDLE_FILE, strerror(errno));
+    state.bundle.data = data;
+    state.bundle.size = (size_t)st.st_size;
+    // validate the index before we touch anything
+    const bundle_t *bundle = data;
+    if (SDL_memcmp(bundle->magic, BUNDLE_MAGIC, 4) || (bundle->version != BUNDLE_VERSION) || (bundle->size != state.bundle.size))
+        panic("Asset bundle (%s) is broken or was built for another client", BUNDLE_FILE);
+    if (!check_asset(bundle->tiles, TILESET_SIZE * TILESET_SIZE * sizeof(uint32_t)))
+        panic("Asset bundle (%s) has a broken tileset", BUNDLE_FILE);
+    state.video.tiles = (const uint32_t*)&state.bundle.data[bundle->tiles];
+    for (int i = 0; i < AUDIO_SOUNDS; ++i) {
+        const uint32_t offset = bundle->sounds[i].offset, length = bundle->sounds[i].length;
+        if (length == 0) continue;
+        if ((length > INT32_MAX / 2) || !check_asset(offset, length * 2))
+            panic("Asset bundle (%s) has a broken sound (%d)", BUNDLE_FILE, i);
+        state.audio.sounds[i] = (sound_t){ .data = (const int16_t*)&state.bundle.data[offset], .length = (int)length };
+    }
+    compose_video(true);
+    state.video.redraw = true;
 }
 
 
 /*==[[ Video Rendering ]]=====================================================*/
 
-// render single tile to screen
-static void render_tile(const int x, const int y, const uint8_t tile) {
-    const SDL_Rect src = { .x = (tile % 16) * TILE_SIZE, .y = (tile / 16) * TILE_SIZE, .w = TILE_SIZE, .h = TILE_SIZE };
-    const SDL_Rect dst = { .x = x * TILE_SIZE, .y = y * TILE_SIZE, .w = TILE_SIZE, .h = TILE_SIZE };
-    SDL_RenderCopy(state.video.renderer, state.video.texture, &src, &dst);
-}
-
-// render the video
-static void render_video(void) {
-    SDL_RenderClear(state.video.renderer);
-    for (int y = 0; y < VIDEO_ROWS; ++y) {
-        for (int x = 0; x < VIDEO_COLS; ++x) {
-            render_tile(x, y, state.video.screen[y][x]);
-        }
+// render the video in a single draw, returns false when nothing changed since the last present
+static bool render_video(void) {
+    if (state.video.dirty) {
+        state.video.dirty = false;
+        if (compose_video(false)) state.video.redraw = true;
     }
+    if (!state.video.redraw)
+        return false;
+    state.video.redraw = false;
+    SDL_UpdateTexture(state.video.texture, NULL, state.video.pixels, sizeof(state.video.pixels[0]));
+    SDL_RenderClear(state.video.renderer);
+    SDL_RenderCopy(state.video.renderer, state.video.texture, NULL, NULL);
     SDL_RenderPresent(state.video.renderer);
+    return true;
 }
 
 
 /*==[[ Audio Rendering ]]=====================================================*/
 
-// render a single audio voice
-static int render_voice(voice_t *voice) {
-    if (voice->sound == NULL)
-        return 0;
-    if (voice->position >= voice->sound->length) {
-        if (voice->loop) {
-            voice->position = 0;
-        } else {
-            voice->sound = NULL;
-            return 0;
+// add 16-bit samples to the 32-bit mixing buffer
+static void mix_samples(int32_t *mix, const int16_t *data, const int count) {
+    int i = 0;
+#if defined(__SSE2__)
+    for (; i + 8 <= count; i += 8) {
+        const __m128i x = _mm_loadu_si128((const __m128i*)&data[i]);
+        // sign extend by unpacking into the upper halves and shifting down
+        const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+        const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+        _mm_storeu_si128((__m128i*)&mix[i], _mm_add_epi32(_mm_loadu_si128((const __m128i*)&mix[i]), lo));
+        _mm_storeu_si128((__m128i*)&mix[i + 4], _mm_add_epi32(_mm_loadu_si128((const __m128i*)&mix[i + 4]), hi));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 8 <= count; i += 8) {
+        const int16x8_t x = vld1q_s16(&data[i]);
+        vst1q_s32(&mix[i], vaddq_s32(vld1q_s32(&mix[i]), vmovl_s16(vget_low_s16(x))));
+        vst1q_s32(&mix[i + 4], vaddq_s32(vld1q_s32(&mix[i + 4]), vmovl_s16(vget_high_s16(x))));
+    }
+#endif
+    for (; i < count; ++i)
+        mix[i] += data[i];
+}
+
+// apply the gain to the mixing buffer and saturate it into the output stream
+static void output_samples(int16_t *stream, const int32_t *mix, const int count, const float gain) {
+    int i = 0;
+#if defined(__SSE2__)
+    const __m128 g = _mm_set1_ps(gain);
+    for (; i + 8 <= count; i += 8) {
+        // truncate like the float to int conversion in C, the pack saturates like clampi()
+        const __m128i lo = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)&mix[i])), g));
+        const __m128i hi = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)&mix[i + 4])), g));
+        _mm_storeu_si128((__m128i*)&stream[i], _mm_packs_epi32(lo, hi));
+    }
+#elif defined(__ARM_NEON)
+    for (; i + 8 <= count; i += 8) {
+        const int32x4_t lo = vcvtq_s32_f32(vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(&mix[i])), gain));
+        const int32x4_t hi = vcvtq_s32_f32(vmulq_n_f32(vcvtq_f32_s32(vld1q_s32(&mix[i + 4])), gain));
+        vst1q_s16(&stream[i], vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+    }
+#endif
+    for (; i < count; ++i)
+        stream[i] = (int16_t)clampi(mix[i] * gain, -32768, 32767);
+}
+
+// mix streamed music into the mixing buffer (plays silence when the loader falls behind)
+static void render_stream(stream_t *stream, int32_t *mix, const int count) {
+    const unsigned read = (unsigned)SDL_AtomicGet(&stream->read);
+    const int available = (int)((unsigned)SDL_AtomicGet(&stream->write) - read);
+    const int total = SDL_min(count, available);
+    const int offset = (int)(read & (AUDIO_STREAM - 1));
+    const int first = SDL_min(total, AUDIO_STREAM - offset);
+    mix_samples(mix, &stream->ring[offset], first);
+    mix_samples(&mix[first], stream->ring, total - first);
+    SDL_AtomicAdd(&stream->read, total);
+}
+
+// mix a single audio voice into the mixing buffer, in runs up to the end of the sound or the block
+static void render_voice(voice_t *voice, int32_t *mix, const int count) {
+    if (voice->stream != NULL) {
+        render_stream(voice->stream, mix, count);
+        return;
+    }
+    for (int done = 0; (voice->sound != NULL) && (done < count);) {
+        if (voice->position >= voice->sound->length) {
+            if (voice->loop && (voice->sound->length > 0)) {
+                voice->position = 0;
+            } else {
+                voice->sound = NULL;
+                return;
+            }
         }
+        const int run = SDL_min(count - done, voice->sound->length - voice->position);
+        mix_samples(&mix[done], &voice->sound->data[voice->position], run);
+        voice->position += run;
+        done += run;
     }
-    return voice->sound->data[voice->position++];
 }
 
 // render all audio voices from SDL callback
@@ -360,11 +764,14 @@ static void render_audio(void *userdata, Uint8 *stream8, int len8) {
     (void)userdata;
     int16_t *stream = (int16_t*)stream8;
     const int len = len8 / 2;
-    for (int i = 0; i < len; ++i) {
-        int total = 0;
+    drain_audio();
+    const float gain = state.audio.mixer_gain;
+    for (int block = 0; block < len; block += AUDIO_BLOCK) {
+        const int count = SDL_min(len - block, AUDIO_BLOCK);
+        SDL_memset(state.audio.mix, 0, count * sizeof(*state.audio.mix));
         for (int j = 0; j < AUDIO_VOICES; ++j)
-            total += render_voice(&state.audio.voices[j]);
-        *stream++ = (int16_t)clampi(total * state.audio.gain, -32768, 32767);
+            render_voice(&state.audio.voices[j], state.audio.mix, count);
+        output_samples(&stream[block], state.audio.mix, count, gain);
     }
 }
 
@@ -406,6 +813,8 @@ static void apply_keyboard(const SDL_KeyCode key, const bool down) {
         case SDLK_F1: if (down) adjust_gain(-0.1f); break;
         case SDLK_F2: if (down) adjust_gain( 0.1f); break;
         case SDLK_F9: if (down) load_assets(); break;
+        case SDLK_F10: if (down) toggle_recording(); break;
+        case SDLK_F11: if (down) take_screenshot(); break;
         case SDLK_F12: if (down) toggle_fullscreen(); break;
         default: break;
     }
@@ -438,28 +847,168 @@ static void handle_SDL_events(void) {
             case SDL_CONTROLLERBUTTONDOWN: apply_gamepad(ev.cbutton.button, true); break;
             case SDL_CONTROLLERBUTTONUP: apply_gamepad(ev.cbutton.button, false); break;
             case SDL_CONTROLLERDEVICEADDED: SDL_GameControllerOpen(ev.cdevice.which); break;
+            case SDL_WINDOWEVENT: state.video.redraw = true; break;
+            case SDL_RENDER_TARGETS_RESET: state.video.redraw = true; break;
+        }
+    }
+}
+
+
+/*==[[ Network Handling ]]====================================================*/
+
+// decode a frame packet from the server into the jitter buffer, returns false when it was stale or could not be decoded
+static bool receive_frame(const uint8_t *data, const int length) {
+    frame_packet_t frame;
+    const uint8_t *payload = decode_frame(data, length, &frame);
+    if (payload == NULL)
+        return false;
+    const uint32_t tick = frame.tick;
+    const uint32_t base = frame.base;
+    // late frames are fine as long as we did not present a newer one and their slot is still ours
+    if ((tick <= state.net.play_tick) || (tick + NETWORK_HISTORY <= state.net.ack_tick))
+        return false;
+    if (state.net.frames[tick % NETWORK_HISTORY].tick == tick)
+        return false;
+    // decode the video into the history slot of this tick
+    const int payload_length = length - PACKET_FRAME_SIZE;
+    uint8_t (*video)[VIDEO_COLS] = state.net.frames[tick % NETWORK_HISTORY].video;
+    state.net.frames[tick % NETWORK_HISTORY].tick = 0;
+    if (base == 0) {
+        if (payload_length != VIDEO_ROWS * VIDEO_COLS) return false;
+        SDL_memcpy(video, payload, payload_length);
+    } else {
+        // we need the baseline frame, otherwise wait for a newer delta or a keyframe
+        if ((base >= tick) || (tick - base >= NETWORK_HISTORY)) return false;
+        if (state.net.frames[base % NETWORK_HISTORY].tick != base) return false;
+        SDL_memcpy(video, state.net.frames[base % NETWORK_HISTORY].video, VIDEO_ROWS * VIDEO_COLS);
+        if (!decode_delta(video, payload, payload_length)) return false;
+    }
+    state.net.frames[tick % NETWORK_HISTORY].tick = tick;
+    state.net.frames[tick % NETWORK_HISTORY].audio = frame.audio;
+    state.net.frames[tick % NETWORK_HISTORY].music = (int8_t)frame.music;
+    if (tick > state.net.ack_tick) {
+        state.net.ack_tick = tick;
+        state.net.silence = 0;
+    }
+    return true;
+}
+
+// echo the cookie of a server challenge, the server gives us a slot once it sees it
+static void answer_challenge(const uint8_t *data, const int length) {
+    challenge_packet_t challenge;
+    uint8_t answer[PACKET_ANSWER_SIZE];
+    if (decode_challenge(data, length, &challenge) == NULL) return;
+    encode_answer(answer, &(answer_packet_t){ .cookie = challenge.cookie });
+    send(state.net.udp, answer, sizeof(answer), 0);
+}
+
+// read all frames which arrived since the last tick
+static void receive_frames(void) {
+    uint8_t data[NETWORK_PACKET];
+    for (;;) {
+        const ssize_t length = recv(state.net.udp, data, sizeof(data), 0);
+        if (length < 0) return;
+        if (packet_type(data, (int)length) == PACKET_CHALLENGE) {
+            answer_challenge(data, (int)length);
+        } else {
+            receive_frame(data, (int)length);
         }
     }
 }
 
+// send our input together with the newest frame we have, plus the buttons of the previous ticks
+static void send_input(void) {
+    uint8_t data[PACKET_INPUT_SIZE + NETWORK_REDUNDANCY];
+    const int count = (state.tick - 1 < NETWORK_REDUNDANCY) ? (int)state.tick - 1 : NETWORK_REDUNDANCY;
+    const input_packet_t input = { .tick = state.tick, .buttons = state.input.down, .ack = state.net.ack_tick, .count = (uint8_t)count };
+    SDL_memcpy(encode_input(data, &input), state.net.inputs, count);
+    send(state.net.udp, data, PACKET_INPUT_SIZE + count, 0);
+    // remember this input for the next packets
+    SDL_memmove(&state.net.inputs[1], &state.net.inputs[0], NETWORK_REDUNDANCY - 1);
+    state.net.inputs[0] = state.input.down;
+}
+
+// present the next frame of the jitter buffer, keeps the last one on a missing tick
+static void present_frame(void) {
+    const uint32_t newest = state.net.ack_tick;
+    if (newest == 0) return;
+    if ((state.net.play_tick == 0) || (newest - state.net.play_tick >= NETWORK_HISTORY)) {
+        // start (or restart after a long stall) with the buffer filled up
+        state.net.play_tick = (newest > NETWORK_DELAY) ? newest - NETWORK_DELAY : 1;
+    } else if (state.net.play_tick < newest) {
+        // catch up when our clock runs slower than the server, wait when the buffer runs dry
+        state.net.play_tick += (newest - state.net.play_tick > 2 * NETWORK_DELAY) ? 2 : 1;
+    } else {
+        return;
+    }
+    const uint32_t tick = state.net.play_tick;
+    if (state.net.frames[tick % NETWORK_HISTORY].tick != tick)
+        return;
+    SDL_memcpy(state.net.screen, state.net.frames[tick % NETWORK_HISTORY].video, sizeof(state.net.screen));
+    const uint32_t audio = state.net.frames[tick % NETWORK_HISTORY].audio;
+    for (int i = 0; i < AUDIO_SOUNDS; ++i)
+        if (audio & (1u << i)) play_sound(i);
+    play_music(state.net.frames[tick % NETWORK_HISTORY].music);
+}
+
+// draw the buttons we hold right now on top of the frame, so input feels immediate despite the delay
+static void draw_input(void) {
+    static const struct { button_t button; char tile; } buttons[] = {
+        { BUTTON_UP, '^' }, { BUTTON_DOWN, 'v' }, { BUTTON_LEFT, '<' }, { BUTTON_RIGHT, '>' },
+        { BUTTON_A, 'A' }, { BUTTON_B, 'B' }, { BUTTON_X, 'X' }, { BUTTON_Y, 'Y' },
+    };
+    int x = VIDEO_COLS - 1;
+    for (int i = (int)SDL_arraysize(buttons) - 1; i >= 0; --i)
+        if (state.input.down & buttons[i].button) draw_tile(x--, VIDEO_ROWS - 1, (uint8_t)buttons[i].tile);
+}
+
+// open the UDP socket and connect it to the server given on the command line
+static void init_network(void) {
+    const char *host = (state.argc > 1) ? state.argv[1] : NETWORK_HOST;
+    const char *port = (state.argc > 2) ? state.argv[2] : NETWORK_PORT;
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM }, *result;
+    const int error = getaddrinfo(host, port, &hints, &result);
+    if (error)
+        panic("getaddrinfo(%s) failed: %s", host, gai_strerror(error));
+    if ((state.net.udp = socket(result->ai_family, result->ai_socktype, result->ai_protocol)) == -1)
+        panic("socket() failed: %s", strerror(errno));
+    if (connect(state.net.udp, result->ai_addr, result->ai_addrlen))
+        panic("connect() failed: %s", strerror(errno));
+    freeaddrinfo(result);
+    if (fcntl(state.net.udp, F_SETFL, O_NONBLOCK))
+        panic("fcntl() failed: %s", strerror(errno));
+}
+
 
 /*==[[ Init / Shutdown / Main Loop ]]=========================================*/
 
 // run single client tick
 static void run_tick(void) {
     state.tick++;
-    clear_screen();
-    draw_text(0, 0, "Hello World!");
-    draw_text(0, 1, format_string("tick: %d", state.tick));
-    draw_text(0, 2, format_string("down: %d", state.input.down));
-    if (state.input.down & BUTTON_A) play_sound(0);
-    if (state.input.down & BUTTON_X) debug_screenshot();
+    // exchange input and frames with the server
+    receive_frames();
+    send_input();
+    present_frame();
+    if ((state.net.ack_tick != 0) && (++state.net.silence > NETWORK_TIMEOUT)) {
+        // the server restarted or dropped us, start over with whatever it sends next
+        SDL_zero(state.net.frames);
+        state.net.ack_tick = state.net.play_tick = state.net.silence = 0;
+    }
+    // show the presented frame plus our local input
+    if (state.net.ack_tick == 0) {
+        clear_screen();
+        draw_text(0, 0, "connecting...");
+    } else {
+        copy_screen(state.net.screen);
+    }
+    draw_input();
+    record_frame();
 }
 
 // run the client main loop
 static void run_client(void) {
     double delta_time = 0.0;
-    uint32_t last_time = SDL_GetTicks();
+    uint32_t last_time = SDL_GetTicks(), last_frame = last_time - (uint32_t)state.video.frame_time;
     while (state.running) {
         // advance time
         uint32_t current_time = SDL_GetTicks();
@@ -470,7 +1019,16 @@ static void run_client(void) {
             run_tick();
         // update client
         handle_SDL_events();
-        render_video();
+        // present changes, but not more often than the frame limit allows
+        const double frame_wait = state.video.frame_time - (double)(current_time - last_frame);
+        if ((frame_wait <= 0.0) && render_video())
+            last_frame = current_time;
+        // sleep until the next tick, input, or the moment we may present a held back frame
+        double wait = TICK_TIME - delta_time;
+        if ((state.video.dirty || state.video.redraw) && (frame_wait < wait))
+            wait = frame_wait;
+        if (wait > 0.0)
+            SDL_WaitEventTimeout(NULL, (int)(wait + 0.999));
     }
 }
 
@@ -479,17 +1037,35 @@ static void quit_client(void) {
     free_assets();
     if (state.audio.device != 0)
         SDL_CloseAudioDevice(state.audio.device);
+    if (state.audio.loader != NULL) {
+        SDL_AtomicSet(&state.audio.loader_running, 0);
+        SDL_SemPost(state.audio.loader_wake);
+        SDL_WaitThread(state.audio.loader, NULL);
+    }
+    if (state.audio.loader_wake != NULL)
+        SDL_DestroySemaphore(state.audio.loader_wake);
+    if (state.capture.thread != NULL) {
+        SDL_AtomicSet(&state.capture.running, 0);
+        SDL_SemPost(state.capture.wake);
+        SDL_WaitThread(state.capture.thread, NULL);
+    }
+    if (state.capture.wake != NULL)
+        SDL_DestroySemaphore(state.capture.wake);
+    if (state.video.texture != NULL)
+        SDL_DestroyTexture(state.video.texture);
     if (state.video.renderer != NULL)
         SDL_DestroyRenderer(state.video.renderer);
     if (state.video.window != NULL)
         SDL_DestroyWindow(state.video.window);
+    if (state.net.udp >= 0)
+        close(state.net.udp);
     SDL_Quit();
 }
 
 // initialize the client
 static void init_client(int argc, char **argv) {
     // init state and SDL2 library
-    state = (struct state_t){ .running = true, .argc = argc, .argv = argv, .audio.gain = 1.0f, .audio.music_id = -1 };
+    state = (struct state_t){ .running = true, .argc = argc, .argv = argv, .audio.gain = 1.0f, .audio.mixer_gain = 1.0f, .audio.music_id = -1, .audio.music_next = -1, .net.udp = -1 };
     atexit(quit_client);
     if (SDL_Init(SDL_INIT_EVERYTHING))
         panic("SDL_Init() failed: %s", SDL_GetError());
@@ -508,19 +1084,37 @@ static void init_client(int argc, char **argv) {
         panic("SDL_CreateRenderer() failed: %s", SDL_GetError());
     if (SDL_RenderSetLogicalSize(state.video.renderer, VIDEO_COLS * TILE_SIZE, VIDEO_ROWS * TILE_SIZE))
         panic("SDL_RenderSetLogicalSize() failed: %s", SDL_GetError());
+    const int fps = (state.argc > 3) ? atoi(state.argv[3]) : VIDEO_FPS;
+    state.video.frame_time = (fps > 0) ? 1000.0 / fps : 0.0;
+    if ((state.video.texture = SDL_CreateTexture(state.video.renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, VIDEO_COLS * TILE_SIZE, VIDEO_ROWS * TILE_SIZE)) == NULL)
+        panic("SDL_CreateTexture() failed: %s", SDL_GetError());
+    // start the capture thread
+    state.capture.session = (long)time(NULL);
+    SDL_AtomicSet(&state.capture.running, 1);
+    if ((state.capture.wake = SDL_CreateSemaphore(0)) == NULL)
+        panic("SDL_CreateSemaphore() failed: %s", SDL_GetError());
+    if ((state.capture.thread = SDL_CreateThread(run_capture, "capture", NULL)) == NULL)
+        panic("SDL_CreateThread() failed: %s", SDL_GetError());
     // init audio system
     const SDL_AudioSpec want = { .format = AUDIO_S16SYS, .freq = AUDIO_RATE, .channels = 1, .samples = 1024, .callback = render_audio };
     SDL_AudioSpec have;
     if ((state.audio.device = SDL_OpenAudioDevice(NULL, SDL_FALSE, &want, &have, 0)) == 0)
         panic("SDL_OpenAudioDevice() failed: %s", SDL_GetError());
     SDL_PauseAudioDevice(state.audio.device, SDL_FALSE);
+    // start the music loader
+    SDL_AtomicSet(&state.audio.loader_running, 1);
+    if ((state.audio.loader_wake = SDL_CreateSemaphore(0)) == NULL)
+        panic("SDL_CreateSemaphore() failed: %s", SDL_GetError());
+    if ((state.audio.loader = SDL_CreateThread(run_loader, "music loader", NULL)) == NULL)
+        panic("SDL_CreateThread() failed: %s", SDL_GetError());
+    // init network system
+    init_network();
 }
 
 // main entry point
 int main(int argc, char **argv) {
     init_client(argc, argv);
     load_assets();
-    play_music(0);
     run_client();
     return 0;
 }
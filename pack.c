@@ -0,0 +1,145 @@
+/*
+================================================================================
+
+    tinyMMO - an attempt to write a simple MMO-RPG in my spare time
+    (packs the assets/ directory into the asset bundle of the client)
+    written by Sebastian Steinhauer <s.steinhauer@yahoo.de>
+
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <https://unlicense.org>
+
+================================================================================
+*/
+/*==[[ Includes ]]============================================================*/
+#define _POSIX_C_SOURCE 200112L // same feature set as the client
+
+#include <stdio.h>
+
+// pull in the whole client, we want its bundle layout and helpers
+#define main client_main
+#include "client.c"
+#undef main
+
+
+/*==[[ Global State ]]========================================================*/
+
+static struct pack_t {
+    uint8_t                     *data; // bundle we build in memory
+    size_t                      size; // bytes used so far
+} pack;
+
+
+/*==[[ Packing ]]=============================================================*/
+
+// reserve aligned space at the end of the bundle, returns its offset
+static uint32_t append_data(const size_t size) {
+    const size_t offset = (pack.size + BUNDLE_ALIGN - 1) & ~(size_t)(BUNDLE_ALIGN - 1);
+    if (offset + size > UINT32_MAX)
+        panic("Asset bundle grows too large");
+    if ((pack.data = SDL_realloc(pack.data, offset + size)) == NULL)
+        panic("Out of memory");
+    SDL_memset(&pack.data[pack.size], 0, offset + size - pack.size);
+    pack.size = offset + size;
+    return (uint32_t)offset;
+}
+
+// convert the tileset into the pixel format of the streaming texture
+static uint32_t pack_tileset(const char *filename) {
+    SDL_Surface *surface = SDL_LoadBMP(filename);
+    if (surface == NULL)
+        panic("SDL_LoadBMP(%s) failed: %s", filename, SDL_GetError());
+    if ((surface->w != TILESET_SIZE) || (surface->h != TILESET_SIZE))
+        panic("Tileset image (%s) has wrong size", filename);
+    SDL_Surface *tiles = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_ARGB8888, 0);
+    SDL_FreeSurface(surface);
+    if (tiles == NULL)
+        panic("SDL_ConvertSurfaceFormat() failed: %s", SDL_GetError());
+    const size_t row = TILESET_SIZE * sizeof(uint32_t);
+    const uint32_t offset = append_data(TILESET_SIZE * row);
+    for (int y = 0; y < TILESET_SIZE; ++y)
+        SDL_memcpy(&pack.data[offset + y * row], (const uint8_t*)tiles->pixels + y * tiles->pitch, row);
+    SDL_FreeSurface(tiles);
+    return offset;
+}
+
+// convert a sound effect into native 16-bit PCM (missing sounds stay empty)
+static void pack_sound(bundle_t *bundle, const int n, const char *filename) {
+    SDL_AudioSpec spec;
+    Uint8 *sample_data;
+    Uint32 sample_length;
+    if (SDL_LoadWAV(filename, &spec, &sample_data, &sample_length) == NULL)
+        return;
+    if (((spec.format != AUDIO_S16LSB) && (spec.format != AUDIO_S16MSB)) || (spec.channels != 1) || (spec.freq != AUDIO_RATE))
+        panic("Sound (%s) is not 16-bit PCM mono 8KHz", filename);
+    const uint32_t length = sample_length / 2, offset = append_data(length * sizeof(int16_t));
+    int16_t *samples = (int16_t*)&pack.data[offset];
+    SDL_memcpy(samples, sample_data, length * sizeof(int16_t));
+    if (spec.format != AUDIO_S16SYS)
+        for (uint32_t i = 0; i < length; ++i) samples[i] = (int16_t)SDL_Swap16((Uint16)samples[i]);
+    SDL_FreeWAV(sample_data);
+    bundle->sounds[n].offset = offset;
+    bundle->sounds[n].length = length;
+}
+
+// write the bundle next to the old one and swap it in, so running clients keep their mapping intact
+static void write_bundle(const char *filename) {
+    char temp[1024];
+    SDL_snprintf(temp, sizeof(temp), "%s.tmp", filename);
+    FILE *fp = fopen(temp, "wb");
+    if (fp == NULL)
+        panic("fopen(%s) failed: %s", temp, strerror(errno));
+    if ((fwrite(pack.data, 1, pack.size, fp) != pack.size) | fclose(fp))
+        panic("Cannot write asset bundle (%s): %s", temp, strerror(errno));
+    if (rename(temp, filename))
+        panic("rename(%s) failed: %s", filename, strerror(errno));
+}
+
+
+/*==[[ Main ]]================================================================*/
+
+int main(int argc, char **argv) {
+    const char *filename = (argc > 1) ? argv[1] : BUNDLE_FILE;
+    char sound[64];
+    int sounds = 0;
+    // the header goes first, we fill it in once everything is packed
+    append_data(sizeof(bundle_t));
+    bundle_t bundle = { .version = BUNDLE_VERSION };
+    SDL_memcpy(bundle.magic, BUNDLE_MAGIC, sizeof(bundle.magic));
+    bundle.tiles = pack_tileset("assets/tiles.bmp");
+    for (int i = 0; i < AUDIO_SOUNDS; ++i) {
+        SDL_snprintf(sound, sizeof(sound), "assets/sound%02d.wav", i);
+        pack_sound(&bundle, i, sound);
+        if (bundle.sounds[i].length > 0) ++sounds;
+    }
+    bundle.size = (uint32_t)pack.size;
+    SDL_memcpy(pack.data, &bundle, sizeof(bundle));
+    write_bundle(filename);
+    SDL_Log("Packed the tileset and %d sounds into %s (%u bytes)", sounds, filename, bundle.size);
+    SDL_free(pack.data);
+    return 0;
+}
+
+
+/*==[[  ]]====================================================================*/
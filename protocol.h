@@ -0,0 +1,231 @@
+/*
+================================================================================
+
+    tinyMMO - an attempt to write a simple MMO-RPG in my spare time
+    (wire protocol shared by server, client and bot)
+    written by Sebastian Steinhauer <s.steinhauer@yahoo.de>
+
+    This is free and unencumbered software released into the public domain.
+
+    Anyone is free to copy, modify, publish, use, compile, sell, or
+    distribute this software, either in source code form or as a compiled
+    binary, for any purpose, commercial or non-commercial, and by any
+    means.
+
+    In jurisdictions that recognize copyright laws, the author or authors
+    of this software dedicate any and all copyright interest in the
+    software to the public domain. We make this dedication for the benefit
+    of the public at large and to the detriment of our heirs and
+    successors. We intend this dedication to be an overt act of
+    relinquishment in perpetuity of all present and future rights to this
+    software under copyright law.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.
+    IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR ANY CLAIM, DAMAGES OR
+    OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+    ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+    OTHER DEALINGS IN THE SOFTWARE.
+
+    For more information, please refer to <https://unlicense.org>
+
+================================================================================
+*/
+#ifndef TINYMMO_PROTOCOL_H
+#define TINYMMO_PROTOCOL_H
+
+/*==[[ Includes ]]============================================================*/
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if !defined(__BYTE_ORDER__)
+#error "the byte order of this compiler is unknown"
+#endif
+
+
+/*==[[ Packet Schema ]]=======================================================*/
+//  every packet is [version:1] [type:1] followed by its fields (big-endian, in this order)
+//  and an optional payload. Add fields at the end of a packet and bump PROTOCOL_VERSION on
+//  every change, peers drop packets of other versions.
+
+enum {
+    PROTOCOL_VERSION            = 1, // wire protocol version (first byte of every packet)
+
+    VIDEO_COLS                  = 16, // tile columns (at most 16, a delta row has a 16-bit column mask)
+    VIDEO_ROWS                  = 16, // tile rows (at most 16, a delta has a 16-bit row mask)
+};
+
+// packet types (second byte of every packet)
+typedef enum {
+    PACKET_INPUT                = 1, // client -> server: buttons of a tick and the newest frame we have
+    PACKET_FRAME                = 2, // server -> client: output of a tick
+    PACKET_CHALLENGE            = 3, // server -> unknown address: cookie to echo before it gets a slot
+    PACKET_ANSWER               = 4, // unknown address -> server: the echoed cookie
+} packet_type_t;
+
+// input payload: buttons of tick - 1, tick - 2, ... (count of them, to replay lost packets)
+#define PACKET_INPUT_FIELDS(FIELD) \
+    FIELD(uint32, tick) /* client tick */ \
+    FIELD(uint8, buttons) /* buttons down during the tick */ \
+    FIELD(uint32, ack) /* newest server tick we decoded (0 = none) */ \
+    FIELD(uint8, count) /* redundant buttons in the payload */
+
+// frame payload: video, delta encoded against the frame of the base tick or a keyframe when base is 0
+#define PACKET_FRAME_FIELDS(FIELD) \
+    FIELD(uint32, tick) /* server tick of the client */ \
+    FIELD(uint32, audio) /* sound effects to play (bit mask) */ \
+    FIELD(uint8, music) /* music track to play (255 = none) */ \
+    FIELD(uint32, base) /* tick the video delta is based on (0 = keyframe) */
+
+#define PACKET_CHALLENGE_FIELDS(FIELD) \
+    FIELD(uint32, cookie) /* connection cookie of the address */
+
+#define PACKET_ANSWER_FIELDS(FIELD) \
+    FIELD(uint32, cookie) /* connection cookie we were challenged with */
+
+// all packets: name, type, fields
+#define PROTOCOL_PACKETS(PACKET) \
+    PACKET(input, PACKET_INPUT, PACKET_INPUT_FIELDS) \
+    PACKET(frame, PACKET_FRAME, PACKET_FRAME_FIELDS) \
+    PACKET(challenge, PACKET_CHALLENGE, PACKET_CHALLENGE_FIELDS) \
+    PACKET(answer, PACKET_ANSWER, PACKET_ANSWER_FIELDS)
+
+
+/*==[[ Integer Codec ]]=======================================================*/
+
+// convert between host and wire (big-endian) byte order
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define PROTOCOL_SWAP16(x)      __builtin_bswap16(x)
+#define PROTOCOL_SWAP32(x)      __builtin_bswap32(x)
+#else
+#define PROTOCOL_SWAP16(x)      (x)
+#define PROTOCOL_SWAP32(x)      (x)
+#endif
+
+// read 16-bit big-endian integer
+static inline uint16_t read_uint16(const uint8_t *data) {
+    uint16_t x;
+    memcpy(&x, data, sizeof(x));
+    return PROTOCOL_SWAP16(x);
+}
+
+// read 32-bit big-endian integer
+static inline uint32_t read_uint32(const uint8_t *data) {
+    uint32_t x;
+    memcpy(&x, data, sizeof(x));
+    return PROTOCOL_SWAP32(x);
+}
+
+// write 16-bit big-endian integer
+static inline void write_uint16(uint8_t *data, const uint16_t x) {
+    const uint16_t wire = PROTOCOL_SWAP16(x);
+    memcpy(data, &wire, sizeof(wire));
+}
+
+// write 32-bit big-endian integer
+static inline void write_uint32(uint8_t *data, const uint32_t x) {
+    const uint32_t wire = PROTOCOL_SWAP32(x);
+    memcpy(data, &wire, sizeof(wire));
+}
+
+// field codecs of every width, they return the position behind the field
+static inline uint8_t *put_uint8(uint8_t *data, const uint8_t x) { data[0] = x; return data + 1; }
+static inline uint8_t *put_uint16(uint8_t *data, const uint16_t x) { write_uint16(data, x); return data + 2; }
+static inline uint8_t *put_uint32(uint8_t *data, const uint32_t x) { write_uint32(data, x); return data + 4; }
+static inline const uint8_t *get_uint8(const uint8_t *data, uint8_t *x) { *x = data[0]; return data + 1; }
+static inline const uint8_t *get_uint16(const uint8_t *data, uint16_t *x) { *x = read_uint16(data); return data + 2; }
+static inline const uint8_t *get_uint32(const uint8_t *data, uint32_t *x) { *x = read_uint32(data); return data + 4; }
+
+
+/*==[[ Packet Codecs ]]=======================================================*/
+
+// field structures: input_packet_t, frame_packet_t, ...
+#define PROTOCOL_MEMBER(width, name) width##_t name;
+#define PROTOCOL_STRUCT(name, type, FIELDS) typedef struct name##_packet_t { FIELDS(PROTOCOL_MEMBER) } name##_packet_t;
+PROTOCOL_PACKETS(PROTOCOL_STRUCT)
+
+// encoded sizes without the payload: PACKET_INPUT_SIZE, PACKET_FRAME_SIZE, ...
+#define PROTOCOL_FIELD_SIZE(width, name) + (int)sizeof(width##_t)
+#define PROTOCOL_SIZE(name, type, FIELDS) type##_SIZE = 2 FIELDS(PROTOCOL_FIELD_SIZE),
+enum { PROTOCOL_PACKETS(PROTOCOL_SIZE) };
+
+// encoders: encode_input(data, packet), ... write the packet and return where its payload goes
+//  (the fields are unrolled at fixed offsets, so every field is a single store)
+#define PROTOCOL_ENCODE_FIELD(width, name) data = put_##width(data, packet->name);
+#define PROTOCOL_ENCODER(name, type, FIELDS) \
+    static inline uint8_t *encode_##name(uint8_t *data, const name##_packet_t *packet) { \
+        data[0] = PROTOCOL_VERSION; \
+        data[1] = type; \
+        data += 2; \
+        FIELDS(PROTOCOL_ENCODE_FIELD) \
+        return data; \
+    }
+PROTOCOL_PACKETS(PROTOCOL_ENCODER)
+
+// decoders: decode_input(data, length, packet), ... return the payload or NULL for a short packet,
+//  another type or another protocol version
+#define PROTOCOL_DECODE_FIELD(width, name) data = get_##width(data, &packet->name);
+#define PROTOCOL_DECODER(name, type, FIELDS) \
+    static inline const uint8_t *decode_##name(const uint8_t *data, const int length, name##_packet_t *packet) { \
+        if ((length < type##_SIZE) || (data[0] != PROTOCOL_VERSION) || (data[1] != type)) return NULL; \
+        data += 2; \
+        FIELDS(PROTOCOL_DECODE_FIELD) \
+        return data; \
+    }
+PROTOCOL_PACKETS(PROTOCOL_DECODER)
+
+// return the type of a packet (0 = too short or another protocol version)
+static inline int packet_type(const uint8_t *data, const int length) {
+    return ((length >= 2) && (data[0] == PROTOCOL_VERSION)) ? data[1] : 0;
+}
+
+
+/*==[[ Video Codec ]]=========================================================*/
+//  frame payloads are either a keyframe (VIDEO_ROWS * VIDEO_COLS tiles) or a delta against the base tick:
+//  [dirty row mask:2] then for every dirty row: [dirty column mask:2] [tiles of the dirty columns]
+
+// encode video as delta against base, returns the encoded size or -1 when a keyframe would not be larger
+static inline int encode_delta(uint8_t *data, const uint8_t base[VIDEO_ROWS][VIDEO_COLS], const uint8_t video[VIDEO_ROWS][VIDEO_COLS]) {
+    enum { LIMIT = VIDEO_ROWS * VIDEO_COLS };
+    uint16_t rows = 0;
+    int length = 2;
+    for (int y = 0; y < VIDEO_ROWS; ++y) {
+        uint16_t cols = 0;
+        for (int x = 0; x < VIDEO_COLS; ++x)
+            if (base[y][x] != video[y][x]) cols |= 1 << x;
+        if (cols == 0) continue;
+        // the worst case is a full row plus its mask, bail out before we outgrow a keyframe
+        if (length + 2 + VIDEO_COLS > LIMIT) return -1;
+        rows |= 1 << y;
+        write_uint16(&data[length], cols);
+        length += 2;
+        for (int x = 0; x < VIDEO_COLS; ++x)
+            if (cols & (1 << x)) data[length++] = video[y][x];
+    }
+    write_uint16(&data[0], rows);
+    return length;
+}
+
+// apply a delta encoded video update on top of its baseline, returns false for a malformed delta
+static inline bool decode_delta(uint8_t video[VIDEO_ROWS][VIDEO_COLS], const uint8_t *data, const int length) {
+    if (length < 2)
+        return false;
+    const uint16_t rows = read_uint16(data);
+    int pos = 2;
+    for (int y = 0; y < VIDEO_ROWS; ++y) {
+        if ((rows & (1 << y)) == 0) continue;
+        if (pos + 2 > length) return false;
+        const uint16_t cols = read_uint16(&data[pos]);
+        pos += 2;
+        for (int x = 0; x < VIDEO_COLS; ++x) {
+            if ((cols & (1 << x)) == 0) continue;
+            if (pos >= length) return false;
+            video[y][x] = data[pos++];
+        }
+    }
+    return pos == length;
+}
+
+#endif // TINYMMO_PROTOCOL_H
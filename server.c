@@ -32,6 +32,19 @@
 ================================================================================
 */
 /*==[[ Includes ]]============================================================*/
+#define _GNU_SOURCE // recvmmsg() and friends
+
+// platform features: batched datagram syscalls and the readiness API we block on
+#if defined(__linux__)
+#define HAVE_MMSG
+#define HAVE_EPOLL
+#elif defined(__FreeBSD__)
+#define HAVE_MMSG
+#define HAVE_KQUEUE
+#elif defined(__APPLE__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__)
+#define HAVE_KQUEUE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
@@ -39,32 +52,87 @@
 #include <stdbool.h>
 #include <string.h>
 #include <time.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/errno.h>
-#include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include "protocol.h"
+#if defined(HAVE_EPOLL)
+#include <sys/epoll.h>
+#if defined(__GLIBC__) && ((__GLIBC__ > 2) || ((__GLIBC__ == 2) && (__GLIBC_MINOR__ >= 35)))
+#define HAVE_EPOLL_PWAIT2 // nanosecond timeouts (the kernel might still be older than 5.11)
+#endif
+#elif defined(HAVE_KQUEUE)
+#include <sys/event.h>
+#else
+#include <poll.h>
+#endif
 
 
 /*==[[ Defines / Enums ]]======================================================*/
 enum {
-    TICK_RATE                   = 20, // 20 ticks per second
+    TICK_RATE                   = 20, // default: 20 ticks per second
+    TICK_RATE_MAX               = 1000, // most ticks per second we accept
+
+    NETWORK_PORT                = 6502, // default: UDP port we want to open
+    NETWORK_CLIENTS             = 1024, // default: maximum amount of clients we support
+    NETWORK_CLIENTS_MAX         = 1 << 24, // most clients per worker we accept (the address index size stays an int)
+    NETWORK_TIMEOUT             = 10, // default: kick clients after 10s of silence
+    NETWORK_TIMEOUT_MAX         = 3600, // longest timeout we accept in seconds
+    NETWORK_BATCH               = 64, // datagrams we receive with a single syscall
+    NETWORK_PACKET              = 1024, // size of a single packet buffer
+    NETWORK_BUFFER              = 4 << 20, // socket send / receive buffer size (a full tick burst has to fit)
+    NETWORK_WORKERS             = 1, // default: worker threads, each with its own socket and shard of clients
+    NETWORK_WORKERS_MAX         = 256, // most worker threads we accept
+
+    NETWORK_HISTORY             = 16, // sent frames we remember per client as delta baselines
+    NETWORK_SCREENS             = 256, // default: shared screens many clients can watch at once
+    NETWORK_SCREENS_MAX         = 1 << 16, // most shared screens we accept
+    NETWORK_CACHE               = 4, // encoded deltas we keep per shared screen and tick (by base tick)
+    NETWORK_RATE                = 60, // default: packets per second an address may send (clients send 20)
+    NETWORK_RATE_MAX            = 100000, // highest rate limit we accept
+    NETWORK_COOKIE              = 5, // seconds a cookie generation lasts (a cookie is valid for its own and the next one)
+    NETWORK_CHALLENGES          = 64, // cookie challenges a worker sends per tick (caps what spoofed floods cost)
+
+    STATS_INTERVAL              = 60, // default: log statistics every minute
+    STATS_BUCKETS               = 38 * 16, // latency histogram buckets (16 per power of two, up to 2^41 ns)
 
-    NETWORK_PORT                = 6502, // UDP port we want to open
-    NETWORK_CLIENTS             = 1024, // maximum amount of clients we support
-    NETWORK_TIMEOUT             = TICK_RATE * 10, // kick clients after 10s of silence
+    LOG_SLOTS                   = 1024, // log messages which can wait for the writer thread (power of two)
+    LOG_MESSAGE                 = 256, // longest log message (longer ones are cut)
+    LOG_BUFFER                  = 64 << 10, // the writer thread writes up to this many bytes at once
+    LOG_INTERVAL                = 10, // the writer thread checks for new messages every 10ms
 
-    VIDEO_COLS                  = 16, // tile columns
-    VIDEO_ROWS                  = 16, // tile rows
+    SNAPSHOT_INTERVAL           = 1, // every session is saved and synced to disk once a second
+    SNAPSHOT_WAIT               = 100, // the snapshot thread checks whether it should stop every 100ms
+    SNAPSHOT_VERSION            = 2, // snapshot file layout
+
+    RECORD_BUFFER               = 256 << 10, // received packets a worker collects before it writes them to the recording
+    RECORD_HEADER               = 25, // [tick:4] [worker:1] [length:2] [ip:16] [port:2] in front of every recorded packet
+    RECORD_VERSION              = 2, // recording file layout (and protocol version of the packets in it)
+
+    JOB_CLIENTS                 = 64, // clients per on_client job (the unit idle workers steal)
+    JOB_COMMANDS                = 128, // world commands a job can queue (more are dropped)
+
+    MEMORY_HUGE_PAGES           = 2 << 20, // client tables at least this large ask for huge pages
 
     AUDIO_SOUNDS                = 32, // we have 32 sound effects
     AUDIO_TRACKS                = 8, // we have 8 music tracks
+
+    NETWORK_HEADER              = PACKET_FRAME_SIZE, // size of the packet header in front of the video data
+    NETWORK_FRAME               = NETWORK_HEADER + VIDEO_ROWS * VIDEO_COLS, // largest packet we send to a client
 };
 
-#define TICK_TIME               (1.0 / (double)TICK_RATE)
+#define SNAPSHOT_MAGIC          "TMMOSNAP"
+#define RECORD_MAGIC            "TMMOREC0"
 
 // button bit-masks
 typedef enum {
@@ -78,13 +146,16 @@ typedef enum {
     BUTTON_RIGHT                = 128,
 } button_t;
 
+// world commands on_client can queue
+typedef enum {
+    COMMAND_TILE                = 1, // set a tile of a shared screen
+} command_type_t;
+
 
 /*==[[ Types ]]===============================================================*/
 
-// client structure
+// client structure (the part of a client the game code works with)
 typedef struct client_t {
-    bool                        connected; // flag if the client is connected
-
     // input system
     struct {
         uint8_t                 down; // buttons which are currently down
@@ -92,31 +163,322 @@ typedef struct client_t {
     } input;
     // output system
     struct {
-        uint8_t                 video[VIDEO_ROWS][VIDEO_COLS]; // screen content for the client
+        uint8_t                 (*video)[VIDEO_COLS]; // screen content for the client (VIDEO_ROWS rows in the video pool)
         uint32_t                audio; // sound effects which should play
         int8_t                  music; // which music should play
+        int                     screen; // shared screen to show instead of video (-1 = own video)
     } output;
-    // network system
-    struct {
-        struct sockaddr_in      addr; // network address of this client
-        uint64_t                last_tick; // last global tick we received data
-        uint32_t                send_tick; // tick we are going to send
-        uint32_t                recv_tick; // tick we have received from client
-    } net;
 } client_t;
 
+// world mutation queued by on_client, applied after all clients ran
+typedef struct command_t {
+    uint8_t                     type; // COMMAND_*
+    uint8_t                     x, y; // tile position
+    uint8_t                     tile; // tile to set
+    int                         screen; // shared screen to change
+} command_t;
+
+// a chunk of clients whose on_client calls run together, with the world commands they queued
+typedef struct job_t {
+    int                         count; // commands queued
+    int                         dropped; // commands lost because the job was full
+    command_t                   commands[JOB_COMMANDS]; // commands in the order they were queued
+} job_t;
+
+// client address as session key (IPv4 clients get IPv4-mapped IPv6 addresses, so both families look the same)
+//  there is no room for the scope id, so link-local IPv6 peers (fe80::/10) are not admitted, our replies would not reach them
+typedef struct address_t {
+    uint8_t                     ip[16]; // IPv6 address (network byte order)
+    uint16_t                    port; // UDP port (network byte order)
+} address_t;
+
+// socket address of either family (what the kernel hands us and wants back)
+typedef union endpoint_t {
+    struct sockaddr             sa; // generic view
+    struct sockaddr_in          in; // IPv4 (only with an IPv4 socket)
+    struct sockaddr_in6         in6; // IPv6 (IPv4 clients of a dual-stack socket arrive IPv4-mapped)
+} endpoint_t;
+
+// network session of a client
+typedef struct session_t {
+    address_t                   addr; // network address of this client
+    uint32_t                    send_tick; // tick we are going to send
+    uint32_t                    recv_tick; // tick we have received from client
+    uint32_t                    ack_tick; // latest of our ticks the client acknowledged (0 = none)
+} session_t;
+
+// client slot in the snapshot file
+typedef struct snapshot_slot_t {
+    uint32_t                    checksum; // over everything below, catches slots torn by a crash
+    uint64_t                    tick; // server tick the slot was saved at (0 = unused slot)
+    session_t                   session; // network state
+    client_t                    client; // game state (the video pointer is not restored)
+    uint8_t                     video[VIDEO_ROWS][VIDEO_COLS]; // own video of the client
+} snapshot_slot_t;
+
+// header of the snapshot file, followed by the shared screens and the slots of every worker
+typedef struct snapshot_header_t {
+    char                        magic[8]; // SNAPSHOT_MAGIC
+    uint32_t                    version; // SNAPSHOT_VERSION
+    uint32_t                    slot_size; // size of a snapshot slot (changes with the structures)
+    int32_t                     workers; // configuration the snapshot belongs to
+    int32_t                     clients; // (slots are kept per worker, so all of these have to match)
+    int32_t                     screens;
+    uint64_t                    tick; // newest server tick in the snapshot
+} snapshot_header_t;
+
+// header of an input recording, followed by the records of all received packets (tick order)
+//  (a replay takes over everything which decides what happens to a packet, so it gets the same results)
+typedef struct record_header_t {
+    char                        magic[8]; // RECORD_MAGIC
+    uint32_t                    version; // RECORD_VERSION
+    int32_t                     workers; // configuration of the recording server
+    int32_t                     clients;
+    int32_t                     tick_rate;
+    int32_t                     screens;
+    int32_t                     rate;
+    uint32_t                    timeout; // in ticks
+    uint64_t                    tick; // server tick the recording starts at
+    uint64_t                    secret[2]; // cookie key of the recording server
+} record_header_t;
+
+// preformatted log message waiting for the writer thread
+typedef struct log_slot_t {
+    uint32_t                    sequence; // ring position this slot is ready for (position + 1 = message ready)
+    int                         length; // message length
+    time_t                      time; // wall clock second the message was logged
+    char                        message[LOG_MESSAGE]; // message without timestamp and newline
+} log_slot_t;
+
+// log-linear latency histogram (in nanoseconds, about 6% precision)
+typedef struct histogram_t {
+    uint64_t                    count; // recorded values
+    uint64_t                    max; // largest recorded value
+    uint32_t                    buckets[STATS_BUCKETS]; // value counts
+} histogram_t;
+
+// network statistics and phase timings of a worker
+typedef struct stats_t {
+    uint64_t                    recv_packets; // packets received
+    uint64_t                    recv_calls; // receive syscalls made
+    uint64_t                    recv_bytes; // payload bytes received
+    uint64_t                    recv_drops; // packets we ignored (malformed, stale or server full)
+    uint64_t                    recv_limited; // packets over the rate limit of their address
+    uint64_t                    challenges; // cookie challenges sent to unknown addresses
+    uint64_t                    challenges_deferred; // packets of unknown addresses we did not challenge (tick budget used up)
+    uint64_t                    bad_cookies; // answers with a wrong or expired cookie
+    uint64_t                    send_packets; // packets sent
+    uint64_t                    send_calls; // send syscalls made
+    uint64_t                    send_drops; // packets the kernel refused to send
+    uint64_t                    send_bytes; // payload bytes sent
+    uint64_t                    keyframes; // video frames sent without a delta baseline
+    uint64_t                    cached; // shared screen deltas we did not have to encode again
+    uint64_t                    late_ticks; // ticks which started more than a quarter tick after their deadline
+    uint64_t                    jobs; // on_client jobs run
+    uint64_t                    stolen; // on_client jobs run for the shard of another worker
+    uint64_t                    commands; // world commands applied
+    uint64_t                    lost_commands; // world commands dropped because their job was full
+
+    // phase timings (lag, on_tick and tick are only measured by worker 0)
+    histogram_t                 lag; // delay between tick deadline and tick start
+    histogram_t                 on_tick; // global game tick, including the world commands
+    histogram_t                 receive; // draining the socket (only when packets arrived)
+    histogram_t                 on_client; // client game logic jobs (own and stolen ones)
+    histogram_t                 encode; // building the packets of the shard
+    histogram_t                 send; // flushing the send arena
+    histogram_t                 tick; // whole tick of worker 0, from the first barrier to the flush
+} stats_t;
+
+// network worker, owns a socket and the shard of clients the kernel routes to it
+typedef struct worker_t {
+    int                         id; // worker number (0 runs on the main thread)
+    pthread_t                   thread; // thread handle (unused for worker 0)
+    int                         udp; // UDP socket
+    int                         family; // address family of the socket (AF_INET6 is dual-stack)
+    int                         poll; // epoll / kqueue descriptor we wait on (unused with poll())
+
+    // all tables below are carved from one allocation sized by the configured client capacity
+
+    // connected clients, packed so the per-tick sweeps only touch live data
+    int                         active_count; // number of connected clients
+    int                         *active; // slots of the connected clients
+    int                         *position; // slot -> position in active (-1 = unused slot)
+
+    // timeout wheel, every client is linked into the bucket of the tick it times out at
+    int                         *wheel; // first slot of every bucket (-1 = empty)
+    struct timeout_t {
+        int                     next, prev; // neighbours in the bucket list (-1 = none)
+        uint32_t                tick; // tick the client times out at
+    } *timers; // timeout links of every slot
+
+    // client slots (slots never move)
+    client_t                    *clients; // game state of the clients
+    session_t                   *sessions; // network state of the clients
+    int                         *index; // open addressing hash: address -> client slot (-1 = empty)
+    int                         *free; // stack of unused client slots
+    int                         free_count; // number of entries in the free stack
+
+    // admission control (unknown addresses have to echo a cookie before they get a slot)
+    struct limit_t {
+        uint32_t                tick; // tick the bucket was refilled at
+        uint32_t                tokens; // packets the address may still send (scaled by the tick rate)
+    } *limits; // token buckets of the client slots
+    struct limit_t              *strangers; // token buckets of unknown addresses, shared by hash
+    int                         challenges; // challenges we may still send this tick
+
+    // on_client jobs of the shard (chunks of active, idle workers steal what we do not get to)
+    job_t                       *jobs; // command buffers of the jobs
+    int                         job_count; // jobs of this tick
+    int                         job_next; // next job to run (atomic, shared with the thieves)
+    uint32_t                    job_tick; // tick the jobs belong to (atomic, only jobs of the current tick are stolen)
+
+    // cold per client buffers, only touched when a packet is built
+    uint8_t                     (*video)[VIDEO_ROWS][VIDEO_COLS]; // video pool
+    uint8_t                     (*history)[NETWORK_HISTORY][VIDEO_ROWS][VIDEO_COLS]; // sent own video frames, indexed by tick
+    struct frame_t {
+        int                     screen; // shared screen we sent (-1 = own video, see history)
+        uint32_t                tick; // server tick of the shared screen snapshot
+    } (*frames)[NETWORK_HISTORY]; // what we sent with each tick of a client
+
+    // encoded shared screen deltas of the current tick (NETWORK_CACHE per screen, picked by base tick)
+    struct cache_t {
+        uint32_t                tick; // server tick this entry was encoded for (0 = empty)
+        uint32_t                flushes; // send arena generation the delta lives in
+        int                     base_screen; // screen of the baseline
+        uint32_t                base_tick; // server tick of the baseline
+        int                     length; // delta length (-1 = a keyframe is smaller)
+        const uint8_t           *data; // delta, behind the header of the packet it was first encoded for
+    } *cache;
+
+    // receive buffers (preallocated, so receiving never touches the stack or heap)
+    struct {
+        uint8_t                 data[NETWORK_BATCH][NETWORK_PACKET]; // packet payloads
+        endpoint_t              addr[NETWORK_BATCH]; // packet source addresses
+#ifdef HAVE_MMSG
+        struct iovec            iov[NETWORK_BATCH]; // payload vectors for recvmmsg()
+        struct mmsghdr          msgs[NETWORK_BATCH]; // message headers for recvmmsg()
+#endif
+    } recv;
+
+    // send arena (all packets of a tick are collected here and flushed at once)
+    //  every packet is a header stamped into the arena plus a video payload, which is either encoded
+    //  right behind the header or points at data that stays put until the flush (snapshots, cached deltas)
+    struct {
+        uint8_t                 *data; // headers and encoded payloads, back to back (NETWORK_FRAME bytes per client)
+        size_t                  size; // capacity of the arena in bytes
+        size_t                  used; // bytes used in the arena
+        int                     count; // packets queued
+        uint32_t                flushes; // times the arena was reset (pointers into it are stale once this changes)
+        struct iovec            *iov; // header and payload vector of the queued packets (two per packet)
+        endpoint_t              *addr; // destinations of the queued packets
+#ifdef HAVE_MMSG
+        struct mmsghdr          *msgs; // message headers for sendmmsg()
+#else
+        struct msghdr           *msgs; // message headers for sendmsg()
+#endif
+    } send;
+
+    int                         snapshot_cursor; // position in active the next share of the snapshot starts at
+
+    // received packets waiting to be written to the recording
+    struct {
+        uint8_t                 *data; // records, back to back (RECORD_BUFFER bytes, empty without a recording)
+        int                     used; // bytes used
+        int                     packets; // packets in the buffer
+    } record;
+
+    stats_t                     stats; // network statistics
+} worker_t;
+
 
 /*==[[ Global State ]]========================================================*/
 
 static struct state_t {
-    bool                        running; // keep the client running
+    volatile sig_atomic_t       running; // keep the server running (cleared by SIGINT / SIGTERM)
+    volatile sig_atomic_t       dump_stats; // log statistics after the next tick (set by SIGUSR1)
+    bool                        stopping; // all workers leave after this tick (decided at the tick barrier)
     uint64_t                    tick; // current global server tick
+    double                      next_tick; // deadline of the next tick
+
+    // configuration (from the command line)
+    struct {
+        int                     port; // UDP port we want to open
+        int                     clients; // maximum amount of clients we support
+        int                     tick_rate; // ticks per second
+        double                  tick_time; // seconds per tick
+        uint32_t                timeout; // kick clients after this many ticks of silence
+        int                     workers; // worker threads
+        int                     stats_interval; // log statistics every this many seconds (0 = never)
+        int                     screens; // shared screens
+        int                     index; // buckets in the client address index (power of two, at least twice the clients)
+        int                     wheel; // buckets of the timeout wheel (power of two, more than the timeout)
+        const char              *snapshot; // file we keep the sessions in (NULL = none)
+        int                     rate; // packets per second an address may send (0 = unlimited)
+        uint32_t                burst; // token bucket size (a second of packets, scaled by the tick rate)
+        int                     strangers; // token buckets for unknown addresses (power of two)
+        uint32_t                cookie; // ticks a cookie generation lasts
+        const char              *record; // file we record the received packets to (NULL = none)
+        const char              *replay; // recording we play instead of opening sockets (NULL = none)
+    } config;
+
+    uint64_t                    secret[2]; // key of the connection cookies (random for every run)
+
+    worker_t                    *workers; // our network workers
+
+    // shared screens (on_tick draws them, the workers read the snapshots)
+    struct {
+        uint8_t                 (*video)[VIDEO_ROWS][VIDEO_COLS]; // current content of every screen
+        uint8_t                 (*history)[VIDEO_ROWS][VIDEO_COLS]; // snapshots after on_tick: [tick % NETWORK_HISTORY * screens + screen]
+    } screens;
+    int                         connected; // connected clients over all workers (atomic)
 
+    // session snapshot (a memory mapped file the workers keep up to date and a background thread syncs to disk)
     struct {
-        int                     udp; // UDP socket
-        client_t                clients[NETWORK_CLIENTS]; // all our clients
-        bool                    sorted; // is true when the client array is sorted
-    } net;
+        int                     fd; // snapshot file
+        uint8_t                 *data; // mapping of the whole file (NULL = no snapshots)
+        size_t                  size; // size of the file
+        snapshot_header_t       *header; // file header
+        uint8_t                 (*screens)[VIDEO_ROWS][VIDEO_COLS]; // saved shared screens
+        snapshot_slot_t         *slots; // saved client slots: [worker * clients + slot]
+        bool                    restore; // the file held a snapshot of our configuration
+        bool                    stopping; // snapshot thread syncs once more and quits
+        pthread_t               thread; // snapshot thread
+    } snapshot;
+
+    // input recording (-R) or replay (-P)
+    struct {
+        FILE                    *file; // recording we write or play (NULL = none)
+        pthread_mutex_t         mutex; // serializes the workers writing their buffers
+        uint8_t                 *data; // replay: records of the current tick
+        size_t                  used; // replay: bytes of records
+        size_t                  size; // replay: size of the record buffer
+        uint8_t                 next[RECORD_HEADER]; // replay: first record of a later tick
+        bool                    pending; // replay: next holds a record
+        bool                    done; // replay: the whole file was read
+        uint64_t                last_tick; // replay: tick the last records were loaded for
+        uint64_t                packets; // packets recorded or replayed
+        uint64_t                first_tick; // replay: tick the recording started at
+        double                  start; // replay: wall clock time it started
+    } record;
+
+    // tick barrier (pthread_barrier_t is not available everywhere)
+    struct {
+        pthread_mutex_t         mutex; // protects the fields below
+        pthread_cond_t          cond; // signaled when the last worker arrives
+        int                     waiting; // workers waiting for the current generation
+        unsigned                generation; // increased whenever the barrier opens
+    } barrier;
+
+    // asynchronous logger (lock-free ring of messages, written to stdout by a background thread)
+    struct {
+        log_slot_t              slots[LOG_SLOTS]; // message ring
+        uint32_t                head; // next position producers claim
+        uint32_t                tail; // next position the writer thread reads
+        uint64_t                dropped; // messages lost because the ring was full
+        bool                    started; // writer thread is running
+        bool                    stopping; // writer thread drains the ring and quits
+        pthread_t               thread; // writer thread
+    } log;
 } state;
 
 
@@ -131,14 +493,118 @@ static void panic(const char *fmt, ...) {
     exit(EXIT_FAILURE);
 }
 
-// log message with timestamp
+// log message with timestamp (never blocks, the message is dropped when the writer thread falls behind)
 static void logger(const char *fmt, ...) {
-    char timestamp[64];
-    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", localtime(&(time_t){time(NULL)}));
-    char message[1024];
+    // claim a free slot, any thread may log at the same time
+    uint32_t position = __atomic_load_n(&state.log.head, __ATOMIC_RELAXED);
+    log_slot_t *slot;
+    for (;;) {
+        slot = &state.log.slots[position & (LOG_SLOTS - 1)];
+        const int32_t diff = (int32_t)(__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) - position);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&state.log.head, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            __atomic_fetch_add(&state.log.dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            position = __atomic_load_n(&state.log.head, __ATOMIC_RELAXED);
+        }
+    }
+    // format the message right into the slot and hand it to the writer thread
     va_list va;
-    va_start(va, fmt); vsnprintf(message, sizeof(message), fmt, va); va_end(va);
-    printf("%s | %s\n", timestamp, message);
+    va_start(va, fmt); const int length = vsnprintf(slot->message, LOG_MESSAGE, fmt, va); va_end(va);
+    slot->length = (length < 0) ? 0 : (length < LOG_MESSAGE) ? length : LOG_MESSAGE - 1;
+    slot->time = time(NULL);
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+// write a whole buffer to stdout
+static void write_output(const char *buffer, size_t size) {
+    while (size > 0) {
+        const ssize_t written = write(STDOUT_FILENO, buffer, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buffer += written;
+        size -= (size_t)written;
+    }
+}
+
+// log writer thread, prints batches of messages and formats the timestamp only once per second
+static void *run_logger(void *arg) {
+    (void)arg;
+    static char buffer[LOG_BUFFER];
+    char timestamp[32] = "";
+    time_t timestamp_time = (time_t)-1;
+    size_t timestamp_length = 0;
+    for (;;) {
+        // anything logged before we were asked to stop is in the ring now
+        const bool stopping = __atomic_load_n(&state.log.stopping, __ATOMIC_ACQUIRE);
+        size_t used = 0;
+        while (used + sizeof(timestamp) + LOG_MESSAGE + 64 <= sizeof(buffer)) {
+            log_slot_t *slot = &state.log.slots[state.log.tail & (LOG_SLOTS - 1)];
+            if (__atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != state.log.tail + 1)
+                break;
+            if (slot->time != timestamp_time) {
+                struct tm tm;
+                timestamp_time = slot->time;
+                timestamp_length = strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S | ", localtime_r(&timestamp_time, &tm));
+            }
+            memcpy(&buffer[used], timestamp, timestamp_length); used += timestamp_length;
+            memcpy(&buffer[used], slot->message, (size_t)slot->length); used += (size_t)slot->length;
+            buffer[used++] = '\n';
+            // give the slot back to the producers
+            __atomic_store_n(&slot->sequence, state.log.tail + LOG_SLOTS, __ATOMIC_RELEASE);
+            state.log.tail++;
+        }
+        // the loop above always leaves 64 bytes for the notice, a truncated one ends there
+        const uint64_t dropped = __atomic_exchange_n(&state.log.dropped, 0, __ATOMIC_RELAXED);
+        if (dropped > 0) {
+            const int length = snprintf(&buffer[used], 64, "%.*sDropped %llu log messages\n",
+                (int)timestamp_length, timestamp, (unsigned long long)dropped);
+            used += (length < 0) ? 0 : (length < 64) ? (size_t)length : 64 - 1;
+        }
+        if (used > 0) {
+            write_output(buffer, used);
+        } else if (stopping) {
+            return NULL;
+        } else {
+            nanosleep(&(struct timespec){ .tv_nsec = LOG_INTERVAL * 1000000L }, NULL);
+        }
+    }
+}
+
+// write all pending log messages and stop the writer thread
+static void quit_logger(void) {
+    if (!state.log.started) return;
+    __atomic_store_n(&state.log.stopping, true, __ATOMIC_RELEASE);
+    pthread_join(state.log.thread, NULL);
+    state.log.started = false;
+}
+
+// start the log writer thread
+static void init_logger(void) {
+    for (uint32_t i = 0; i < LOG_SLOTS; ++i)
+        state.log.slots[i].sequence = i;
+    if (pthread_create(&state.log.thread, NULL, run_logger, NULL))
+        panic("pthread_create() failed");
+    state.log.started = true;
+    atexit(quit_logger);
+}
+
+
+/*==[[ Jobs ]]================================================================*/
+
+// queue a world command from on_client, returns false when the job has no room left
+static inline bool queue_command(job_t *job, const command_t command) {
+    if (job->count == JOB_COMMANDS) {
+        job->dropped++;
+        return false;
+    }
+    job->commands[job->count++] = command;
+    return true;
 }
 
 
@@ -156,6 +622,24 @@ static void on_quit(void) {
 static void on_tick(void) {
 }
 
+// NOTE: with more than one worker on_connect, on_disconnect and on_client run concurrently
+//       for clients of different workers, so they may only touch the client they are given.
+//       on_client runs in jobs of JOB_CLIENTS clients on whichever worker is idle, it changes
+//       the world by queueing commands into its job. on_command and on_tick run alone while
+//       all workers wait, they are the only places to draw into state.screens.video.
+//       on_client shows a shared screen by setting output.screen, all clients on the same
+//       screen share one encoded packet payload.
+
+// callback for a world command of the last tick (in the same order every run: by worker, then client)
+static void on_command(const command_t *command) {
+    switch (command->type) {
+        case COMMAND_TILE:
+            if ((command->screen >= 0) && (command->screen < state.config.screens) && (command->x < VIDEO_COLS) && (command->y < VIDEO_ROWS))
+                state.screens.video[command->screen][command->y][command->x] = command->tile;
+            break;
+    }
+}
+
 // callback for new client
 static void on_connect(client_t *client) {
     (void)client;
@@ -166,177 +650,1386 @@ static void on_disconnect(client_t *client) {
     (void)client;
 }
 
-// callback for every client tick
-static void on_client(client_t *client) {
-    (void)client;
+// callback for every client tick (queue world changes into job, see on_command)
+static void on_client(client_t *client, job_t *job) {
+    (void)client; (void)job;
 }
 
 
-/*==[[ Core Server Implementation ]]==========================================*/
+/*==[[ Profiling ]]===========================================================*/
+
+// return the current monotonic time in nanoseconds
+static uint64_t get_nanos(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+// return the histogram bucket of a value (exact below 16, then 16 sub-buckets per power of two)
+static int histogram_bucket(const uint64_t value) {
+    if (value < 16) return (int)value;
+    const int msb = 63 - __builtin_clzll(value);
+    const int bucket = (msb - 3) * 16 + (int)((value >> (msb - 4)) & 15);
+    return (bucket < STATS_BUCKETS) ? bucket : STATS_BUCKETS - 1;
+}
+
+// return the largest value which falls into a histogram bucket
+static uint64_t histogram_value(const int bucket) {
+    if (bucket < 16) return (uint64_t)bucket;
+    const int msb = bucket / 16 + 3;
+    return ((uint64_t)(16 + bucket % 16 + 1) << (msb - 4)) - 1;
+}
+
+// record a value in a histogram
+static void histogram_add(histogram_t *histogram, const uint64_t value) {
+    histogram->count++;
+    histogram->buckets[histogram_bucket(value)]++;
+    if (value > histogram->max) histogram->max = value;
+}
 
-// read 32-bit big-endian integer
-static uint32_t read_uint32(const uint8_t *data) {
-    return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+// add all values of one histogram to another
+static void histogram_merge(histogram_t *to, const histogram_t *from) {
+    to->count += from->count;
+    if (from->max > to->max) to->max = from->max;
+    for (int i = 0; i < STATS_BUCKETS; ++i)
+        to->buckets[i] += from->buckets[i];
+}
+
+// return the value below which the given fraction of all recorded values lies
+static uint64_t histogram_percentile(const histogram_t *histogram, const double fraction) {
+    const uint64_t rank = (uint64_t)(fraction * (double)histogram->count + 0.5);
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_BUCKETS; ++i) {
+        seen += histogram->buckets[i];
+        if ((seen >= rank) && (seen > 0))
+            return (histogram_value(i) < histogram->max) ? histogram_value(i) : histogram->max;
+    }
+    return histogram->max;
+}
+
+// log p50 / p99 / max of a histogram in milliseconds
+static void log_histogram(const char *name, const histogram_t *histogram) {
+    if (histogram->count == 0) return;
+    logger("  %-10s n=%-8llu p50=%8.3fms p99=%8.3fms max=%8.3fms", name, (unsigned long long)histogram->count,
+        histogram_percentile(histogram, 0.50) / 1e6, histogram_percentile(histogram, 0.99) / 1e6, histogram->max / 1e6);
+}
+
+
+/*==[[ Snapshots ]]===========================================================*/
+
+// checksum of a snapshot slot (FNV-1a over 64-bit words, everything behind the checksum)
+static uint32_t snapshot_checksum(const snapshot_slot_t *slot) {
+    const uint8_t *data = (const uint8_t*)&slot->tick, *end = (const uint8_t*)(slot + 1);
+    uint64_t hash = 14695981039346656037ull;
+    for (uint64_t word; data + sizeof(word) <= end; data += sizeof(word)) {
+        memcpy(&word, data, sizeof(word));
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    for (; data < end; ++data)
+        hash = (hash ^ *data) * 1099511628211ull;
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// return the snapshot slot of a client slot, NULL when we keep no snapshot
+static snapshot_slot_t *snapshot_slot(const worker_t *worker, const int slot) {
+    if (state.snapshot.data == NULL) return NULL;
+    return &state.snapshot.slots[(size_t)worker->id * state.config.clients + slot];
+}
+
+// save a connected client into its snapshot slot
+static void save_slot(const worker_t *worker, const int slot) {
+    snapshot_slot_t *saved = snapshot_slot(worker, slot);
+    if (saved == NULL) return;
+    saved->tick = state.tick;
+    saved->session = worker->sessions[slot];
+    saved->client = worker->clients[slot];
+    memcpy(saved->video, worker->video[slot], sizeof(saved->video));
+    saved->checksum = snapshot_checksum(saved);
+}
+
+// forget a disconnected client
+static void clear_slot(const worker_t *worker, const int slot) {
+    snapshot_slot_t *saved = snapshot_slot(worker, slot);
+    if (saved != NULL) saved->tick = 0;
+}
+
+// save the next share of the connected clients, so each of them is saved once per interval (or all of them at once)
+static void save_sessions(worker_t *worker, const bool all) {
+    if (state.snapshot.data == NULL) return;
+    const int period = SNAPSHOT_INTERVAL * state.config.tick_rate;
+    for (int count = all ? worker->active_count : (worker->active_count + period - 1) / period; count > 0; --count) {
+        if (worker->snapshot_cursor >= worker->active_count) worker->snapshot_cursor = 0;
+        save_slot(worker, worker->active[worker->snapshot_cursor++]);
+    }
 }
 
-// write 32-bit big-endian integer
-static void write_uint32(uint8_t *data, const uint32_t x) {
-    data[0] = (x >> 24) & 255; data[1] = (x >> 16) & 255; data[2] = (x >> 8) & 255; data[3] = x & 255;
+// save the global state (only while the other workers wait)
+static void save_globals(void) {
+    if (state.snapshot.data == NULL) return;
+    state.snapshot.header->tick = state.tick;
+    if ((state.config.screens > 0) && (state.tick % ((uint64_t)SNAPSHOT_INTERVAL * state.config.tick_rate) == 0))
+        memcpy(state.snapshot.screens, state.screens.video, (size_t)state.config.screens * sizeof(*state.screens.video));
 }
 
-// return the current time in seconds
+// snapshot thread, the workers only write to memory and this one waits for the disk
+static void *run_snapshot(void *arg) {
+    (void)arg;
+    for (int waited = 0; !__atomic_load_n(&state.snapshot.stopping, __ATOMIC_ACQUIRE);) {
+        nanosleep(&(struct timespec){ .tv_nsec = SNAPSHOT_WAIT * 1000000L }, NULL);
+        if (++waited * SNAPSHOT_WAIT < SNAPSHOT_INTERVAL * 1000) continue;
+        waited = 0;
+        if (msync(state.snapshot.data, state.snapshot.size, MS_SYNC))
+            logger("msync(%s) failed: %s", state.config.snapshot, strerror(errno));
+    }
+    return NULL;
+}
+
+// sync the snapshot (the workers saved all sessions when they stopped) and stop the snapshot thread
+static void quit_snapshot(void) {
+    if (state.snapshot.data == NULL) return;
+    __atomic_store_n(&state.snapshot.stopping, true, __ATOMIC_RELEASE);
+    pthread_join(state.snapshot.thread, NULL);
+    if (msync(state.snapshot.data, state.snapshot.size, MS_SYNC))
+        logger("msync(%s) failed: %s", state.config.snapshot, strerror(errno));
+    munmap(state.snapshot.data, state.snapshot.size);
+    close(state.snapshot.fd);
+    state.snapshot.data = NULL;
+}
+
+/*==[[ Recording ]]===========================================================*/
+
+// write the buffered records of a worker to the recording
+static void flush_record(worker_t *worker) {
+    if (worker->record.used == 0) return;
+    pthread_mutex_lock(&state.record.mutex);
+    if (fwrite(worker->record.data, 1, worker->record.used, state.record.file) != (size_t)worker->record.used)
+        panic("fwrite(%s) failed: %s", state.config.record, strerror(errno));
+    state.record.packets += worker->record.packets;
+    pthread_mutex_unlock(&state.record.mutex);
+    worker->record.used = worker->record.packets = 0;
+}
+
+// append a received packet to the recording buffer of the worker
+//  [tick:4] [worker:1] [length:2] [ip:16] [port:2] [packet:length] (numbers in host byte order, like the snapshot)
+static void record_packet(worker_t *worker, const address_t *addr, const uint8_t *data, const int length) {
+    if (worker->record.used + RECORD_HEADER + length > RECORD_BUFFER)
+        flush_record(worker);
+    uint8_t *record = &worker->record.data[worker->record.used];
+    const uint32_t tick = (uint32_t)state.tick;
+    const uint16_t size = (uint16_t)length;
+    memcpy(&record[0], &tick, sizeof(tick));
+    record[4] = (uint8_t)worker->id;
+    memcpy(&record[5], &size, sizeof(size));
+    memcpy(&record[7], addr->ip, sizeof(addr->ip));
+    memcpy(&record[23], &addr->port, sizeof(addr->port));
+    memcpy(&record[RECORD_HEADER], data, length);
+    worker->record.used += RECORD_HEADER + length;
+    worker->record.packets++;
+}
+
+// write the packets all workers received during the last tick (only while the other workers wait)
+static void save_records(void) {
+    if (state.config.record == NULL) return;
+    for (int i = 0; i < state.config.workers; ++i)
+        flush_record(&state.workers[i]);
+}
+
+// read the records of the current tick from the replay (only while the other workers wait)
+static void load_records(void) {
+    if (state.config.replay == NULL) return;
+    state.record.used = 0;
+    while (!state.record.done) {
+        uint8_t *header = state.record.next;
+        if (!state.record.pending && (fread(header, 1, RECORD_HEADER, state.record.file) != RECORD_HEADER)) {
+            state.record.done = true;
+            break;
+        }
+        uint32_t tick;
+        uint16_t length;
+        memcpy(&tick, &header[0], sizeof(tick));
+        memcpy(&length, &header[5], sizeof(length));
+        // keep records of a later tick for later
+        state.record.pending = (tick > (uint32_t)state.tick);
+        if (state.record.pending) break;
+        if (state.record.used + RECORD_HEADER + length > state.record.size) {
+            state.record.size = (state.record.size + RECORD_HEADER + length) * 2;
+            if ((state.record.data = realloc(state.record.data, state.record.size)) == NULL)
+                panic("realloc() failed: out of memory");
+        }
+        uint8_t *record = &state.record.data[state.record.used];
+        memcpy(record, header, RECORD_HEADER);
+        // a record cut short (the recording server crashed) ends the replay
+        if (fread(&record[RECORD_HEADER], 1, length, state.record.file) != length) {
+            state.record.done = true;
+            break;
+        }
+        state.record.used += RECORD_HEADER + length;
+        state.record.packets++;
+    }
+    if (state.record.used > 0)
+        state.record.last_tick = state.tick;
+}
+
+// close the recording (the workers stopped, so nothing is added anymore)
+static void quit_record(void) {
+    if (state.record.file == NULL) return;
+    if (state.config.record != NULL) {
+        save_records();
+        logger("Recorded %llu packets to %s", (unsigned long long)state.record.packets, state.config.record);
+    }
+    fclose(state.record.file);
+    state.record.file = NULL;
+}
+
+/*==[[ Core Server Implementation ]]==========================================*/
+
+// return the current time in seconds (monotonic, so wall clock corrections do not shift our ticks)
 static double get_time(void) {
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    return (double)tv.tv_sec + ((double)tv.tv_usec / 1000000.0);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+// turn the source address of a packet into a session key (zero for families we do not speak)
+static address_t make_address(const endpoint_t *endpoint) {
+    address_t addr = {0};
+    if (endpoint->sa.sa_family == AF_INET6) {
+        memcpy(addr.ip, &endpoint->in6.sin6_addr, sizeof(addr.ip));
+        addr.port = endpoint->in6.sin6_port;
+    } else if (endpoint->sa.sa_family == AF_INET) {
+        addr.ip[10] = addr.ip[11] = 0xFF;
+        memcpy(&addr.ip[12], &endpoint->in.sin_addr, 4);
+        addr.port = endpoint->in.sin_port;
+    }
+    return addr;
+}
+
+// turn a session key back into a socket address of the socket family, returns its size
+static socklen_t make_endpoint(const worker_t *worker, const address_t *addr, endpoint_t *endpoint) {
+    if (worker->family == AF_INET6) {
+        endpoint->in6 = (struct sockaddr_in6){ .sin6_family = AF_INET6, .sin6_port = addr->port };
+        memcpy(&endpoint->in6.sin6_addr, addr->ip, sizeof(addr->ip));
+        return sizeof(endpoint->in6);
+    }
+    endpoint->in = (struct sockaddr_in){ .sin_family = AF_INET, .sin_port = addr->port };
+    memcpy(&endpoint->in.sin_addr, &addr->ip[12], 4);
+    return sizeof(endpoint->in);
+}
+
+// load the IP of an address key as two 64-bit words
+static void load_address(const address_t *addr, uint64_t words[2]) {
+    memcpy(words, addr->ip, sizeof(addr->ip));
+}
+
+// hash a client address (IP + port) for the address index
+static uint32_t hash_address(const address_t *addr) {
+    uint64_t words[2];
+    load_address(addr, words);
+    const uint64_t key = (words[0] * 0x9E3779B97F4A7C15ull) ^ words[1] ^ ((uint64_t)addr->port << 48);
+    return (uint32_t)(((key ^ (key >> 29)) * 0xBF58476D1CE4E5B9ull) >> 32);
 }
 
-// client comparator function which is used in qsort/bsearch
-static int compare_clients(const void *a, const void *b) {
-    return memcmp(&((const client_t*)a)->net.addr, &((const client_t*)b)->net.addr, sizeof(struct sockaddr_in));
+// compare two client addresses without branching on the family or the bytes
+static bool same_address(const address_t *a, const address_t *b) {
+    uint64_t x[2], y[2];
+    load_address(a, x);
+    load_address(b, y);
+    return ((x[0] ^ y[0]) | (x[1] ^ y[1]) | (uint64_t)(a->port ^ b->port)) == 0;
 }
 
-// return human readable client address
-static const char *client_address(const client_t *client) {
-    static char buffer[128];
-    char addr[128];
-    inet_ntop(AF_INET, &client->net.addr.sin_addr, addr, sizeof(addr));
-    snprintf(buffer, sizeof(buffer), "%s:%d", addr, ntohs(client->net.addr.sin_port));
+// format human readable client address into buffer (workers log concurrently, so no static buffer)
+static const char *client_address(const session_t *session, char *buffer, const size_t size) {
+    static const uint8_t mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF };
+    char addr[INET6_ADDRSTRLEN];
+    if (memcmp(session->addr.ip, mapped, sizeof(mapped)) == 0) {
+        inet_ntop(AF_INET, &session->addr.ip[12], addr, sizeof(addr));
+        snprintf(buffer, size, "%s:%u", addr, (unsigned)ntohs(session->addr.port));
+    } else {
+        inet_ntop(AF_INET6, session->addr.ip, addr, sizeof(addr));
+        snprintf(buffer, size, "[%s]:%u", addr, (unsigned)ntohs(session->addr.port));
+    }
     return buffer;
 }
 
-// create / find a client for the given address
-static client_t *create_client(const struct sockaddr_in addr) {
-    // make sure our clients are sorted
-    if (!state.net.sorted) {
-        qsort(state.net.clients, NETWORK_CLIENTS, sizeof(client_t), compare_clients);
-        state.net.sorted = true;
+// take a packet from a token bucket, returns false when the address is over its rate
+static bool take_token(struct limit_t *limit) {
+    if (state.config.rate == 0) return true;
+    const uint32_t tick = (uint32_t)state.tick;
+    if (limit->tick != tick) {
+        // add the rate for every tick since the last refill, up to a second worth of packets
+        const uint64_t tokens = limit->tokens + (uint64_t)(tick - limit->tick) * (uint64_t)state.config.rate;
+        limit->tokens = (tokens < state.config.burst) ? (uint32_t)tokens : state.config.burst;
+        limit->tick = tick;
+    }
+    if (limit->tokens < (uint32_t)state.config.tick_rate) return false;
+    limit->tokens -= (uint32_t)state.config.tick_rate;
+    return true;
+}
+
+// compute the connection cookie of an address for a cookie generation
+//  (a keyed mix rather than a MAC: spoofed sources never see their challenge, so they can only guess)
+static uint32_t make_cookie(const address_t *addr, const uint64_t generation) {
+    uint64_t words[2];
+    load_address(addr, words);
+    uint64_t key = (state.secret[0] ^ generation ^ words[0]) * 0x9E3779B97F4A7C15ull;
+    key = ((key ^ (key >> 32)) + (state.secret[1] ^ words[1])) * 0xBF58476D1CE4E5B9ull;
+    key = ((key ^ (key >> 29)) + addr->port) * 0x94D049BB133111EBull;
+    return (uint32_t)((key ^ (key >> 31)) >> 16);
+}
+
+// wait until all workers arrived at the barrier
+static void wait_barrier(void) {
+    if (state.config.workers == 1) return;
+    pthread_mutex_lock(&state.barrier.mutex);
+    const unsigned generation = state.barrier.generation;
+    if (++state.barrier.waiting == state.config.workers) {
+        state.barrier.waiting = 0;
+        state.barrier.generation++;
+        pthread_cond_broadcast(&state.barrier.cond);
+    } else {
+        while (generation == state.barrier.generation)
+            pthread_cond_wait(&state.barrier.cond, &state.barrier.mutex);
+    }
+    pthread_mutex_unlock(&state.barrier.mutex);
+}
+
+// find the index bucket which holds the given address or the empty bucket where it belongs
+static int find_bucket(const worker_t *worker, const address_t *addr) {
+    // the index is never more than half full, so there is always an empty bucket to stop at
+    for (uint32_t i = hash_address(addr);; ++i) {
+        i &= state.config.index - 1;
+        const int slot = worker->index[i];
+        if ((slot < 0) || same_address(&worker->sessions[slot].addr, addr)) return i;
+    }
+}
+
+// remove the entry of the given bucket from the index (backward shift, so we need no tombstones)
+static void remove_bucket(worker_t *worker, int bucket) {
+    for (int i = (bucket + 1) & (state.config.index - 1);; i = (i + 1) & (state.config.index - 1)) {
+        const int slot = worker->index[i];
+        if (slot < 0) break;
+        // move the entry into the hole unless its home bucket lies cyclically in (bucket, i]
+        const int home = hash_address(&worker->sessions[slot].addr) & (state.config.index - 1);
+        if ((bucket <= i) ? ((bucket < home) && (home <= i)) : ((bucket < home) || (home <= i))) continue;
+        worker->index[bucket] = slot;
+        bucket = i;
+    }
+    worker->index[bucket] = -1;
+}
+
+// reset the client table of a worker to an empty state
+static void init_clients(worker_t *worker) {
+    for (int i = 0; i < state.config.index; ++i)
+        worker->index[i] = -1;
+    for (int i = 0; i < state.config.wheel; ++i)
+        worker->wheel[i] = -1;
+    // push slots in reverse order, so the lowest slots are handed out first
+    for (int i = 0; i < state.config.clients; ++i) {
+        worker->free[i] = state.config.clients - 1 - i;
+        worker->position[i] = -1;
+    }
+    worker->free_count = state.config.clients;
+}
+
+// point the batched receive headers at their buffers
+static void init_receive(worker_t *worker) {
+#ifdef HAVE_MMSG
+    for (int i = 0; i < NETWORK_BATCH; ++i) {
+        worker->recv.iov[i] = (struct iovec){ .iov_base = worker->recv.data[i], .iov_len = NETWORK_PACKET };
+        worker->recv.msgs[i].msg_hdr = (struct msghdr){ .msg_name = &worker->recv.addr[i], .msg_namelen = sizeof(worker->recv.addr[i]), .msg_iov = &worker->recv.iov[i], .msg_iovlen = 1 };
+    }
+#endif
+}
+
+// link a client into the timeout wheel bucket of the given tick
+static void schedule_timeout(worker_t *worker, const int slot, const uint32_t tick) {
+    int *bucket = &worker->wheel[tick & (state.config.wheel - 1)];
+    worker->timers[slot].tick = tick;
+    worker->timers[slot].prev = -1;
+    worker->timers[slot].next = *bucket;
+    if (*bucket >= 0) worker->timers[*bucket].prev = slot;
+    *bucket = slot;
+}
+
+// unlink a client from its timeout wheel bucket
+static void cancel_timeout(worker_t *worker, const int slot) {
+    const int next = worker->timers[slot].next, prev = worker->timers[slot].prev;
+    if (prev >= 0) {
+        worker->timers[prev].next = next;
+    } else {
+        worker->wheel[worker->timers[slot].tick & (state.config.wheel - 1)] = next;
     }
+    if (next >= 0) worker->timers[next].prev = prev;
+}
+
+// create / find a client for the given address, returns its slot or -1 when the server is full
+static int create_client(worker_t *worker, const address_t addr) {
     // try to locate an existing client for this addr
-    const client_t needle = { .net.addr = addr };
-    client_t *client = bsearch(&needle, state.net.clients, NETWORK_CLIENTS, sizeof(client_t), compare_clients);
-    if (client != NULL) return client;
-    // client was not found in our list, create a new one
-    // we can simply pick the first client of the array, because zero address will be sorted to the start
-    client = &state.net.clients[0];
-    if (client->connected) return NULL;
-    *client = (client_t){ .connected = true, .net.addr = addr, .output.music = -1 };
-    state.net.sorted = false;
-    logger("Client %s connected", client_address(client));
-    on_connect(client);
-    return client;
+    const int bucket = find_bucket(worker, &addr);
+    if (worker->index[bucket] >= 0) return worker->index[bucket];
+    // client was not found in our index, create a new one in a free slot (if the server is not full)
+    if (worker->free_count == 0) return -1;
+    if (__atomic_fetch_add(&state.connected, 1, __ATOMIC_RELAXED) >= state.config.clients) {
+        __atomic_fetch_sub(&state.connected, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    const int slot = worker->free[--worker->free_count];
+    memset(worker->video[slot], 0, sizeof(worker->video[slot]));
+    worker->clients[slot] = (client_t){ .output.video = worker->video[slot], .output.music = -1, .output.screen = -1 };
+    worker->sessions[slot] = (session_t){ .addr = addr };
+    worker->limits[slot] = (struct limit_t){ .tick = (uint32_t)state.tick, .tokens = state.config.burst };
+    worker->index[bucket] = slot;
+    // append it to the packed list of connected clients
+    const int position = worker->active_count++;
+    worker->active[position] = slot;
+    worker->position[slot] = position;
+    schedule_timeout(worker, slot, (uint32_t)state.tick + state.config.timeout + 1);
+    char name[64];
+    logger("Client %s connected", client_address(&worker->sessions[slot], name, sizeof(name)));
+    on_connect(&worker->clients[slot]);
+    save_slot(worker, slot);
+    return slot;
+}
+
+// take over the sessions the snapshot holds for this worker
+static void restore_sessions(worker_t *worker) {
+    if (!state.snapshot.restore) return;
+    int restored = 0;
+    for (int slot = 0; slot < state.config.clients; ++slot) {
+        const snapshot_slot_t *saved = snapshot_slot(worker, slot);
+        if ((saved->tick == 0) || (saved->tick > state.tick) || (saved->checksum != snapshot_checksum(saved)))
+            continue;
+        const int bucket = find_bucket(worker, &saved->session.addr);
+        if (worker->index[bucket] >= 0) continue;
+        memcpy(worker->video[slot], saved->video, sizeof(worker->video[slot]));
+        worker->clients[slot] = saved->client;
+        worker->clients[slot].output.video = worker->video[slot];
+        // the client saw a tick for every tick since the save and has to start over with a keyframe
+        worker->sessions[slot] = saved->session;
+        worker->sessions[slot].send_tick += (uint32_t)(state.tick - saved->tick);
+        worker->sessions[slot].ack_tick = 0;
+        worker->limits[slot] = (struct limit_t){ .tick = (uint32_t)state.tick, .tokens = state.config.burst };
+        worker->index[bucket] = slot;
+        const int position = worker->active_count++;
+        worker->active[position] = slot;
+        worker->position[slot] = position;
+        schedule_timeout(worker, slot, (uint32_t)state.tick + state.config.timeout + 1);
+        restored++;
+    }
+    // rebuild the free stack from the remaining slots, the lowest ones are handed out first again
+    worker->free_count = 0;
+    for (int slot = state.config.clients - 1; slot >= 0; --slot)
+        if (worker->position[slot] < 0) worker->free[worker->free_count++] = slot;
+    __atomic_fetch_add(&state.connected, restored, __ATOMIC_RELAXED);
 }
 
 // remove client from our server
-static void destroy_client(client_t *client) {
-    logger("Client %s disconnected", client_address(client));
-    on_disconnect(client);
-    *client = (client_t){0};
-    state.net.sorted = false;
+static void destroy_client(worker_t *worker, const int slot) {
+    char name[64];
+    logger("Client %s disconnected", client_address(&worker->sessions[slot], name, sizeof(name)));
+    on_disconnect(&worker->clients[slot]);
+    clear_slot(worker, slot);
+    remove_bucket(worker, find_bucket(worker, &worker->sessions[slot].addr));
+    cancel_timeout(worker, slot);
+    // move the last connected client into the hole, so the packed list stays dense
+    const int position = worker->position[slot], last = --worker->active_count;
+    worker->active[position] = worker->active[last];
+    worker->position[worker->active[position]] = position;
+    worker->position[slot] = -1;
+    worker->free[worker->free_count++] = slot;
+    __atomic_fetch_sub(&state.connected, 1, __ATOMIC_RELAXED);
+}
+
+// drop all queued packets and the payloads they point into the arena
+static void reset_packets(worker_t *worker) {
+    worker->send.used = worker->send.count = 0;
+    worker->send.flushes++;
+}
+
+#ifdef HAVE_MMSG
+// send all queued packets in batches
+static void flush_packets(worker_t *worker) {
+    if (worker->udp < 0) {
+        // a replay builds the packets, but has nobody to send them to
+        reset_packets(worker);
+        return;
+    }
+    for (int sent = 0; sent < worker->send.count;) {
+        const int result = sendmmsg(worker->udp, &worker->send.msgs[sent], worker->send.count - sent, 0);
+        worker->stats.send_calls++;
+        if (result > 0) {
+            sent += result;
+            worker->stats.send_packets += result;
+            for (int i = sent - result; i < sent; ++i)
+                worker->stats.send_bytes += worker->send.msgs[i].msg_len;
+        } else if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == ENOBUFS)) {
+            // socket buffer is full, the rest of this tick is lost
+            worker->stats.send_drops += worker->send.count - sent;
+            break;
+        } else {
+            // the first pending packet failed on its own, skip it
+            worker->stats.send_drops++;
+            sent++;
+        }
+    }
+    reset_packets(worker);
+}
+#else
+// send all queued packets one by one
+static void flush_packets(worker_t *worker) {
+    if (worker->udp < 0) {
+        // a replay builds the packets, but has nobody to send them to
+        reset_packets(worker);
+        return;
+    }
+    for (int i = 0; i < worker->send.count; ++i) {
+        const ssize_t result = sendmsg(worker->udp, &worker->send.msgs[i], 0);
+        worker->stats.send_calls++;
+        if (result < 0) {
+            worker->stats.send_drops++;
+        } else {
+            worker->stats.send_packets++;
+            worker->stats.send_bytes += result;
+        }
+    }
+    reset_packets(worker);
+}
+#endif
+
+// reserve space for the header and an encoded payload of the next packet in the send arena
+static uint8_t *begin_packet(worker_t *worker) {
+    if ((worker->send.count == state.config.clients) || (worker->send.size - worker->send.used < NETWORK_FRAME))
+        flush_packets(worker);
+    return &worker->send.data[worker->send.used];
+}
+
+// queue the header written by begin_packet() followed by length bytes of payload
+//  (the payload has to stay valid until the flush, a payload right behind the header stays in the arena)
+static void end_packet(worker_t *worker, const address_t *addr, const uint8_t *payload, const int length) {
+    const int i = worker->send.count++;
+    uint8_t *header = &worker->send.data[worker->send.used];
+    struct iovec *iov = &worker->send.iov[i * 2];
+    iov[0] = (struct iovec){ .iov_base = header, .iov_len = NETWORK_HEADER };
+    iov[1] = (struct iovec){ .iov_base = (void*)payload, .iov_len = length };
+    const socklen_t addr_len = make_endpoint(worker, addr, &worker->send.addr[i]);
+    const struct msghdr msg = { .msg_name = &worker->send.addr[i], .msg_namelen = addr_len, .msg_iov = iov, .msg_iovlen = 2 };
+#ifdef HAVE_MMSG
+    worker->send.msgs[i] = (struct mmsghdr){ .msg_hdr = msg };
+#else
+    worker->send.msgs[i] = msg;
+#endif
+    worker->send.used += NETWORK_HEADER + ((payload == &header[NETWORK_HEADER]) ? length : 0);
+}
+
+// return the video a client got with one of its ticks, NULL when the shared snapshot is gone
+static const uint8_t (*find_frame(const worker_t *worker, const int slot, const uint32_t tick))[VIDEO_COLS] {
+    const struct frame_t *frame = &worker->frames[slot][tick % NETWORK_HISTORY];
+    if (frame->screen < 0)
+        return worker->history[slot][tick % NETWORK_HISTORY];
+    if ((uint32_t)state.tick - frame->tick >= NETWORK_HISTORY)
+        return NULL;
+    return state.screens.history[(frame->tick % NETWORK_HISTORY) * state.config.screens + frame->screen];
+}
+
+// encode a shared screen against a shared baseline, every pair is only encoded once per tick
+//  (into data the first time, later packets of the tick point at that copy in the send arena)
+static int encode_screen(worker_t *worker, uint8_t *data, const uint8_t **payload, const int screen, const struct frame_t *base,
+    const uint8_t base_video[VIDEO_ROWS][VIDEO_COLS], const uint8_t video[VIDEO_ROWS][VIDEO_COLS]) {
+    struct cache_t *cache = &worker->cache[screen * NETWORK_CACHE + base->tick % NETWORK_CACHE];
+    if ((cache->tick == (uint32_t)state.tick) && (cache->flushes == worker->send.flushes) && (cache->base_screen == base->screen) && (cache->base_tick == base->tick)) {
+        worker->stats.cached++;
+    } else {
+        cache->tick = (uint32_t)state.tick;
+        cache->flushes = worker->send.flushes;
+        cache->base_screen = base->screen;
+        cache->base_tick = base->tick;
+        cache->length = encode_delta(data, base_video, video);
+        cache->data = data;
+    }
+    *payload = cache->data;
+    return cache->length;
 }
 
 // handle a single client
-static void handle_client(client_t *client) {
-    // handle client logic
-    on_client(client);
-    // send update packet to client
-    uint8_t data[1024];
-    write_uint32(&data[0], ++client->net.send_tick);
-    write_uint32(&data[4], client->output.audio);
-    data[8] = client->output.music;
-    memcpy(&data[9], client->output.video, sizeof(client->output.video));
-    sendto(state.net.udp, data, sizeof(client->output.video) + 9, 0, (const struct sockaddr*)&client->net.addr, sizeof(client->net.addr));
+static void handle_client(worker_t *worker, const int slot) {
+    client_t *client = &worker->clients[slot];
+    session_t *session = &worker->sessions[slot];
+    // pick the shared screen snapshot of this tick or the own video of the client
+    const int screen = ((client->output.screen >= 0) && (client->output.screen < state.config.screens)) ? client->output.screen : -1;
+    const uint8_t (*video)[VIDEO_COLS] = (screen >= 0)
+        ? state.screens.history[(state.tick % NETWORK_HISTORY) * state.config.screens + screen]
+        : worker->video[slot];
+    // queue update packet for the client (a frame packet, its header is written once we know the base)
+    const uint32_t tick = ++session->send_tick;
+    const uint32_t base = session->ack_tick;
+    uint8_t *data = begin_packet(worker);
+    // remember what we send, shared screens are kept in the global snapshots
+    const struct frame_t *frame = &worker->frames[slot][base % NETWORK_HISTORY];
+    const uint8_t (*base_video)[VIDEO_COLS] = ((base != 0) && (tick - base < NETWORK_HISTORY)) ? find_frame(worker, slot, base) : NULL;
+    worker->frames[slot][tick % NETWORK_HISTORY] = (struct frame_t){ .screen = screen, .tick = (uint32_t)state.tick };
+    if (screen < 0) {
+        // the history copy doubles as the keyframe payload, the game may change the video before the flush
+        memcpy(worker->history[slot][tick % NETWORK_HISTORY], video, VIDEO_ROWS * VIDEO_COLS);
+        video = worker->history[slot][tick % NETWORK_HISTORY];
+    }
+    // encode the delta right behind the header, or point at the cached delta of the shared screen
+    const uint8_t *payload = &data[NETWORK_HEADER];
+    int length = -1;
+    if (base_video == NULL) {
+        // no usable baseline (first frame, lost acks or the shared baseline is too old)
+    } else if ((screen >= 0) && (frame->screen >= 0)) {
+        length = encode_screen(worker, &data[NETWORK_HEADER], &payload, screen, frame, base_video, video);
+    } else {
+        length = encode_delta(&data[NETWORK_HEADER], base_video, video);
+    }
+    const bool keyframe = (length < 0);
+    if (keyframe) {
+        // send a keyframe straight from the snapshot (too much change or no baseline)
+        payload = &video[0][0];
+        length = VIDEO_ROWS * VIDEO_COLS;
+        worker->stats.keyframes++;
+    }
+    const frame_packet_t header = {
+        .tick = tick, .audio = client->output.audio, .music = (uint8_t)client->output.music,
+        .base = keyframe ? 0 : base,
+    };
+    encode_frame(data, &header);
+    end_packet(worker, &session->addr, payload, length);
     // reset audio and pressed state
     client->output.audio = 0;
     client->input.pressed = 0;
 }
 
-// receive UDP packets
-static void receive_packets(void) {
-    for (;;) {
+// apply the buttons of one client tick, edges add up until the next server tick consumes them
+static void apply_input(client_t *client, const uint8_t down) {
+    client->input.pressed |= (~client->input.down) & down;
+    client->input.down = down;
+}
+
+// send a connection cookie to an unknown address
+static void send_challenge(worker_t *worker, const address_t *addr) {
+    uint8_t data[PACKET_CHALLENGE_SIZE];
+    encode_challenge(data, &(challenge_packet_t){ .cookie = make_cookie(addr, state.tick / state.config.cookie) });
+    endpoint_t endpoint;
+    const socklen_t endpoint_len = make_endpoint(worker, addr, &endpoint);
+    if ((worker->udp < 0) || (sendto(worker->udp, data, sizeof(data), 0, &endpoint.sa, endpoint_len) == (ssize_t)sizeof(data))) {
+        worker->stats.challenges++;
+    } else {
+        worker->stats.send_drops++;
+    }
+}
+
+// handle a packet from an address without a slot, only the answer with a valid cookie gets one
+static void admit_client(worker_t *worker, const address_t *addr, const uint8_t *data, const int length) {
+    // link-local peers are only reachable through the interface of their scope id, which the key drops
+    if ((addr->ip[0] == 0xFE) && ((addr->ip[1] & 0xC0) == 0x80)) {
+        worker->stats.recv_drops++;
+        return;
+    }
+    // strangers share their buckets by hash, so spoofed floods cannot drain the buckets of connected clients
+    if (!take_token(&worker->strangers[hash_address(addr) & (state.config.strangers - 1)])) {
+        worker->stats.recv_limited++;
+        return;
+    }
+    answer_packet_t answer;
+    input_packet_t input;
+    if (decode_answer(data, length, &answer) != NULL) {
+        // the current and the previous generation are valid, so a cookie never expires right after we sent it
+        const uint32_t cookie = answer.cookie;
+        const uint64_t generation = state.tick / state.config.cookie;
+        if ((cookie != make_cookie(addr, generation)) && (cookie != make_cookie(addr, generation - 1))) {
+            worker->stats.bad_cookies++;
+        } else if (create_client(worker, *addr) < 0) {
+            worker->stats.recv_drops++;
+        }
+        return;
+    }
+    // challenge input, a challenge is smaller than the input packet it answers (nobody can use us as an amplifier)
+    if (decode_input(data, length, &input) == NULL) {
+        worker->stats.recv_drops++;
+    } else if (worker->challenges == 0) {
+        worker->stats.challenges_deferred++;
+    } else {
+        worker->challenges--;
+        send_challenge(worker, addr);
+    }
+}
+
+// handle a single received UDP packet (input of a client or the answer to a challenge)
+static void handle_packet(worker_t *worker, const address_t *addr, const uint8_t *data, const int length) {
+    worker->stats.recv_bytes += length;
+    if (state.config.record != NULL)
+        record_packet(worker, addr, data, length);
+    if (packet_type(data, length) == 0) {
+        worker->stats.recv_drops++;
+        return;
+    }
+    // find client for this packet, unknown addresses go through the cookie handshake first
+    const int slot = worker->index[find_bucket(worker, addr)];
+    if (slot < 0) {
+        admit_client(worker, addr, data, length);
+        return;
+    }
+    if (!take_token(&worker->limits[slot])) {
+        worker->stats.recv_limited++;
+        return;
+    }
+    client_t *client = &worker->clients[slot];
+    session_t *session = &worker->sessions[slot];
+    // handle the client and receive the input (stale ones and repeated answers are dropped)
+    input_packet_t input;
+    const uint8_t *inputs = decode_input(data, length, &input);
+    if ((inputs == NULL) || (input.tick <= session->recv_tick)) {
+        worker->stats.recv_drops++;
+        return;
+    }
+    // replay the ticks we missed from the redundant copies (oldest first), so no button press gets lost
+    if (session->recv_tick != 0) {
+        const uint32_t available = (uint32_t)(length - PACKET_INPUT_SIZE);
+        const uint32_t count = (input.count < available) ? input.count : available;
+        const uint32_t missed = input.tick - session->recv_tick - 1;
+        for (uint32_t i = (missed < count) ? missed : count; i > 0; --i)
+            apply_input(client, inputs[i - 1]);
+    }
+    session->recv_tick = input.tick;
+    apply_input(client, input.buttons);
+    // push the timeout back (only once per tick, further packets would land in the same bucket)
+    const uint32_t timeout = (uint32_t)state.tick + state.config.timeout + 1;
+    if (worker->timers[slot].tick != timeout) {
+        cancel_timeout(worker, slot);
+        schedule_timeout(worker, slot, timeout);
+    }
+    // remember the newest frame the client has, so we can send deltas against it
+    if ((input.ack > session->ack_tick) && (input.ack <= session->send_tick))
+        session->ack_tick = input.ack;
+}
+
+#ifdef HAVE_MMSG
+// receive UDP packets in batches, returns the number of packets received
+static int receive_packets(worker_t *worker) {
+    for (int total = 0;;) {
+        // the kernel overwrites the address lengths, so reset them before every call
+        for (int i = 0; i < NETWORK_BATCH; ++i)
+            worker->recv.msgs[i].msg_hdr.msg_namelen = sizeof(worker->recv.addr[i]);
+        const int received = recvmmsg(worker->udp, worker->recv.msgs, NETWORK_BATCH, 0, NULL);
+        worker->stats.recv_calls++;
+        if (received <= 0) return total;
+        worker->stats.recv_packets += received;
+        for (int i = 0; i < received; ++i) {
+            const address_t addr = make_address(&worker->recv.addr[i]);
+            handle_packet(worker, &addr, worker->recv.data[i], (int)worker->recv.msgs[i].msg_len);
+        }
+        // a partial batch means the socket is drained
+        total += received;
+        if (received < NETWORK_BATCH) return total;
+    }
+}
+#else
+// receive UDP packets one by one, returns the number of packets received
+static int receive_packets(worker_t *worker) {
+    for (int total = 0;; ++total) {
         // receive next UDP packet if available
-        uint8_t data[1024];
-        struct sockaddr_in addr = {0};
-        socklen_t addr_len = sizeof(addr);
-        int received = recvfrom(state.net.udp, data, sizeof(data), 0, (struct sockaddr*)&addr, &addr_len);
-        if (received <= 0) return;
-        if (received < 5) continue;
-        // find client for this packet
-        client_t *client = create_client(addr);
-        if (client == NULL) continue;
-        // handle the client and receive the input
-        const uint32_t tick = read_uint32(&data[0]);
-        if (tick <= client->net.recv_tick) continue;
-        client->net.last_tick = state.tick;
-        client->net.recv_tick = tick;
-        client->input.pressed = (~client->input.down) & data[4];
-        client->input.down = data[4];
-    }
-}
-
-// run server tick
-static void run_tick(void) {
+        endpoint_t *addr = &worker->recv.addr[0];
+        socklen_t addr_len = sizeof(*addr);
+        const int received = recvfrom(worker->udp, worker->recv.data[0], NETWORK_PACKET, 0, (struct sockaddr*)addr, &addr_len);
+        worker->stats.recv_calls++;
+        if (received < 0) return total;
+        worker->stats.recv_packets++;
+        const address_t key = make_address(addr);
+        handle_packet(worker, &key, worker->recv.data[0], received);
+    }
+}
+#endif
+
+// feed the recorded packets of this worker for the current tick into the server, returns their number
+static int replay_packets(worker_t *worker) {
+    int total = 0;
+    for (size_t offset = 0; offset < state.record.used;) {
+        const uint8_t *record = &state.record.data[offset];
+        uint16_t length;
+        memcpy(&length, &record[5], sizeof(length));
+        offset += RECORD_HEADER + length;
+        if (record[4] != worker->id) continue;
+        address_t addr;
+        memcpy(addr.ip, &record[7], sizeof(addr.ip));
+        memcpy(&addr.port, &record[23], sizeof(addr.port));
+        handle_packet(worker, &addr, &record[RECORD_HEADER], length);
+        total++;
+    }
+    worker->stats.recv_packets += total;
+    return total;
+}
+
+// claim the next on_client job of a worker, returns -1 when all of them are taken
+static int claim_job(worker_t *owner) {
+    const int job = __atomic_fetch_add(&owner->job_next, 1, __ATOMIC_RELAXED);
+    return (job < owner->job_count) ? job : -1;
+}
+
+// run the on_client calls of a job, its commands stay with the owner of the clients
+static void run_job(worker_t *owner, const int job) {
+    const int end = ((job + 1) * JOB_CLIENTS < owner->active_count) ? (job + 1) * JOB_CLIENTS : owner->active_count;
+    for (int i = job * JOB_CLIENTS; i < end; ++i)
+        on_client(&owner->clients[owner->active[i]], &owner->jobs[job]);
+}
+
+// run the jobs of our shard, then steal the jobs other workers did not get to yet
+static void run_jobs(worker_t *worker) {
+    // thieves only look at jobs of the current tick, so publish the count before the tick
+    worker->job_count = (worker->active_count + JOB_CLIENTS - 1) / JOB_CLIENTS;
+    worker->job_next = 0;
+    __atomic_store_n(&worker->job_tick, (uint32_t)state.tick, __ATOMIC_RELEASE);
+    for (int job; (job = claim_job(worker)) >= 0; worker->stats.jobs++)
+        run_job(worker, job);
+    // a worker which has not published yet runs all of its jobs itself
+    for (int i = 1; i < state.config.workers; ++i) {
+        worker_t *owner = &state.workers[(worker->id + i) % state.config.workers];
+        if (__atomic_load_n(&owner->job_tick, __ATOMIC_ACQUIRE) != (uint32_t)state.tick) continue;
+        for (int job; (job = claim_job(owner)) >= 0; worker->stats.jobs++, worker->stats.stolen++)
+            run_job(owner, job);
+    }
+}
+
+// apply the world commands the jobs of the last tick queued (by worker, then client, whoever ran the job)
+static void merge_commands(void) {
+    for (int i = 0; i < state.config.workers; ++i) {
+        worker_t *worker = &state.workers[i];
+        for (int j = 0; j < worker->job_count; ++j) {
+            job_t *job = &worker->jobs[j];
+            for (int k = 0; k < job->count; ++k)
+                on_command(&job->commands[k]);
+            worker->stats.commands += job->count;
+            worker->stats.lost_commands += job->dropped;
+            job->count = job->dropped = 0;
+        }
+    }
+}
+
+// log and reset the statistics of all workers (only while the other workers wait)
+static void log_stats(void) {
+    static stats_t total; // too large for the stack
+    total = (stats_t){0};
+    for (int i = 0; i < state.config.workers; ++i) {
+        const stats_t *stats = &state.workers[i].stats;
+        total.recv_packets += stats->recv_packets; total.recv_calls += stats->recv_calls;
+        total.recv_bytes += stats->recv_bytes; total.recv_drops += stats->recv_drops;
+        total.recv_limited += stats->recv_limited; total.challenges += stats->challenges;
+        total.challenges_deferred += stats->challenges_deferred; total.bad_cookies += stats->bad_cookies;
+        total.send_packets += stats->send_packets; total.send_calls += stats->send_calls;
+        total.send_drops += stats->send_drops; total.send_bytes += stats->send_bytes;
+        total.keyframes += stats->keyframes; total.cached += stats->cached; total.late_ticks += stats->late_ticks;
+        total.jobs += stats->jobs; total.stolen += stats->stolen;
+        total.commands += stats->commands; total.lost_commands += stats->lost_commands;
+        histogram_merge(&total.lag, &stats->lag); histogram_merge(&total.on_tick, &stats->on_tick);
+        histogram_merge(&total.receive, &stats->receive); histogram_merge(&total.on_client, &stats->on_client);
+        histogram_merge(&total.encode, &stats->encode); histogram_merge(&total.send, &stats->send);
+        histogram_merge(&total.tick, &stats->tick);
+        state.workers[i].stats = (stats_t){0};
+    }
+    const double per_call = total.recv_calls ? (double)total.recv_packets / (double)total.recv_calls : 0.0;
+    logger("Received %llu packets in %llu syscalls (%.2f packets per syscall), %llu ignored, %llu bytes",
+        (unsigned long long)total.recv_packets, (unsigned long long)total.recv_calls, per_call,
+        (unsigned long long)total.recv_drops, (unsigned long long)total.recv_bytes);
+    logger("Admission: %llu challenges sent, %llu deferred, %llu bad cookies, %llu packets over the rate limit",
+        (unsigned long long)total.challenges, (unsigned long long)total.challenges_deferred,
+        (unsigned long long)total.bad_cookies, (unsigned long long)total.recv_limited);
+    const double per_send = total.send_calls ? (double)total.send_packets / (double)total.send_calls : 0.0;
+    logger("Sent %llu packets in %llu syscalls (%.2f packets per syscall), %llu dropped, %llu bytes, %llu keyframes, %llu shared deltas",
+        (unsigned long long)total.send_packets, (unsigned long long)total.send_calls, per_send,
+        (unsigned long long)total.send_drops, (unsigned long long)total.send_bytes,
+        (unsigned long long)total.keyframes, (unsigned long long)total.cached);
+    logger("Ticks: %llu, %llu late, %d clients, budget %.3fms", (unsigned long long)total.tick.count,
+        (unsigned long long)total.late_ticks, __atomic_load_n(&state.connected, __ATOMIC_RELAXED), state.config.tick_time * 1e3);
+    logger("Jobs: %llu on_client jobs (%llu stolen), %llu world commands (%llu dropped)",
+        (unsigned long long)total.jobs, (unsigned long long)total.stolen,
+        (unsigned long long)total.commands, (unsigned long long)total.lost_commands);
+    log_histogram("lag", &total.lag);
+    log_histogram("on_tick", &total.on_tick);
+    log_histogram("receive", &total.receive);
+    log_histogram("on_client", &total.on_client);
+    log_histogram("encode", &total.encode);
+    log_histogram("send", &total.send);
+    log_histogram("tick", &total.tick);
+}
+
+// run the global server tick (on worker 0 while all other workers wait)
+static void run_tick(worker_t *worker) {
+    // measure how late we start this tick (a replay runs as fast as it can, so it is never late)
+    if (state.config.replay != NULL)
+        state.next_tick = get_time();
+    const double lag = get_time() - state.next_tick;
+    histogram_add(&worker->stats.lag, (uint64_t)(lag * 1e9));
+    if (lag > state.config.tick_time / 4.0)
+        worker->stats.late_ticks++;
     // increase the global tick
     state.tick++;
-    // handle the global game
+    state.next_tick += state.config.tick_time;
+    // handle the global game, after the world changes the clients asked for during the last tick
+    const uint64_t start = get_nanos();
+    merge_commands();
     on_tick();
-    // iterate over all clients
-    for (int i = 0; i < NETWORK_CLIENTS; ++i) {
-        client_t *client = &state.net.clients[i];
-        if (!client->connected) {
+    histogram_add(&worker->stats.on_tick, get_nanos() - start);
+    // snapshot the shared screens, clients keep using them as delta baselines for a while
+    if (state.config.screens > 0)
+        memcpy(state.screens.history[(state.tick % NETWORK_HISTORY) * state.config.screens], state.screens.video,
+            (size_t)state.config.screens * sizeof(*state.screens.video));
+    // log statistics periodically or when asked to
+    const uint64_t interval = (uint64_t)state.config.stats_interval * state.config.tick_rate;
+    if (((interval != 0) && (state.tick % interval == 0)) || state.dump_stats) {
+        state.dump_stats = 0;
+        log_stats();
+    }
+    save_globals();
+    save_records();
+    // the workers feed the packets of this tick before the next one, a replay ends once the last ones were handled
+    load_records();
+    if (state.record.done && (state.tick > state.record.last_tick + 1))
+        state.running = 0;
+    // decide here, so all workers agree on the last tick
+    state.stopping = !state.running;
+}
+
+// remove all clients of a worker which time out in this tick
+static void expire_clients(worker_t *worker) {
+    // timeouts are never further away than the wheel size, so everybody in this bucket is due
+    const int *bucket = &worker->wheel[state.tick & (state.config.wheel - 1)];
+    while (*bucket >= 0)
+        destroy_client(worker, *bucket);
+}
+
+// run the client tick of a worker
+static void run_clients(worker_t *worker) {
+    expire_clients(worker);
+    worker->challenges = NETWORK_CHALLENGES;
+    // run the game logic of all connected clients, and of other shards once ours is done
+    const uint64_t start = get_nanos();
+    run_jobs(worker);
+    histogram_add(&worker->stats.on_client, get_nanos() - start);
+    // thieves may still run jobs of our shard, so wait for all of them before we encode
+    wait_barrier();
+    const uint64_t game = get_nanos();
+    // queue the update packets of all connected clients
+    for (int i = 0; i < worker->active_count; ++i)
+        handle_client(worker, worker->active[i]);
+    const uint64_t encode = get_nanos();
+    // send all client updates at once
+    flush_packets(worker);
+    const uint64_t send = get_nanos();
+    histogram_add(&worker->stats.encode, encode - game);
+    histogram_add(&worker->stats.send, send - encode);
+}
+
+// block until the UDP socket becomes readable or the timeout (in seconds) passed
+//  (millisecond timeouts are rounded down, the caller polls through the rest so the tick does not start late)
+static void wait_packets(worker_t *worker, const double timeout) {
+    if (timeout <= 0.0) return;
+#if defined(HAVE_EPOLL_PWAIT2) || defined(HAVE_KQUEUE)
+    const struct timespec ts = { .tv_sec = (time_t)timeout, .tv_nsec = (long)((timeout - (double)(time_t)timeout) * 1000000000.0) };
+#endif
+#if defined(HAVE_EPOLL)
+    struct epoll_event event;
+#if defined(HAVE_EPOLL_PWAIT2)
+    static int pwait2 = 1; // cleared once the kernel turns out to lack epoll_pwait2()
+    if (__atomic_load_n(&pwait2, __ATOMIC_RELAXED)) {
+        if ((epoll_pwait2(worker->poll, &event, 1, &ts, NULL) >= 0) || (errno != ENOSYS)) return;
+        __atomic_store_n(&pwait2, 0, __ATOMIC_RELAXED);
+    }
+#endif
+    epoll_wait(worker->poll, &event, 1, (int)(timeout * 1000.0));
+#elif defined(HAVE_KQUEUE)
+    struct kevent event;
+    kevent(worker->poll, NULL, 0, &event, 1, &ts);
+#else
+    struct pollfd pfd = { .fd = worker->udp, .events = POLLIN };
+    poll(&pfd, 1, (int)(timeout * 1000.0));
+#endif
+}
+
+// main loop of a worker (worker 0 runs on the main thread)
+static void *run_worker(void *arg) {
+    worker_t *worker = arg;
+    for (;;) {
+        // handle everything which arrived, then sleep until the next packet or the tick deadline
+        const uint64_t start = get_nanos();
+        if (((state.config.replay != NULL) ? replay_packets(worker) : receive_packets(worker)) > 0)
+            histogram_add(&worker->stats.receive, get_nanos() - start);
+        const double timeout = (state.config.replay != NULL) ? 0.0 : state.next_tick - get_time();
+        if (timeout > 0.0) {
+            wait_packets(worker, timeout);
             continue;
-        } else if (state.tick - client->net.last_tick > NETWORK_TIMEOUT) {
-            destroy_client(client);
-        } else {
-            handle_client(client);
         }
+        // all workers meet at the deadline, worker 0 runs the global tick alone
+        const uint64_t tick_start = get_nanos();
+        wait_barrier();
+        if (worker->id == 0)
+            run_tick(worker);
+        wait_barrier();
+        if (state.stopping)
+            break;
+        run_clients(worker);
+        save_sessions(worker, false);
+        if (worker->id == 0)
+            histogram_add(&worker->stats.tick, get_nanos() - tick_start);
     }
+    // leave a complete snapshot behind, so a restart resumes every session
+    save_sessions(worker, true);
+    return NULL;
 }
 
 // run the server
 static void run_server(void) {
     on_init();
-    double delta_time = 0.0;
-    double last_time = get_time();
-    while (state.running) {
-        // advance in time
-        double current_time = get_time();
-        delta_time += current_time - last_time;
-        last_time = current_time;
-        // advance in ticks
-        for (; delta_time >= TICK_TIME; delta_time -= TICK_TIME)
-            run_tick();
-        // receive UDP data and sleep
-        receive_packets();
-        usleep(10000);
-    }
+    state.record.start = get_time();
+    state.next_tick = get_time() + state.config.tick_time;
+    for (int i = 1; i < state.config.workers; ++i)
+        if (pthread_create(&state.workers[i].thread, NULL, run_worker, &state.workers[i]))
+            panic("pthread_create() failed");
+    run_worker(&state.workers[0]);
+    for (int i = 1; i < state.config.workers; ++i)
+        pthread_join(state.workers[i].thread, NULL);
     on_quit();
+    if (state.config.replay != NULL) {
+        const double elapsed = get_time() - state.record.start, played = (double)(state.tick - state.record.first_tick) * state.config.tick_time;
+        logger("Replayed %llu packets over %llu ticks in %.3fs (%.1fx real time)", (unsigned long long)state.record.packets,
+            (unsigned long long)(state.tick - state.record.first_tick), elapsed, (elapsed > 0.0) ? played / elapsed : 0.0);
+    }
 }
 
 // shutdown the whole server
 static void quit_server(void) {
+    if (state.workers != NULL)
+        log_stats();
     logger("Stopping server ...");
 }
 
-// initialize the server
-static void init_server(void) {
-    // init state
-    state = (struct state_t){ .running = true };
-    atexit(quit_server);
-    logger("Starting server ...");
-    // open UDP server socket
-    if ((state.net.udp = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+// stop the server after the current tick (SIGINT / SIGTERM) or dump statistics (SIGUSR1)
+static void handle_signal(int signal) {
+    if (signal == SIGUSR1) {
+        state.dump_stats = 1;
+    } else {
+        state.running = 0;
+    }
+}
+
+// allocate zeroed memory pages (large tables are backed by transparent huge pages where available)
+static void *allocate_memory(const size_t size) {
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED)
+        panic("mmap() failed: %s", strerror(errno));
+#ifdef MADV_HUGEPAGE
+    if (size >= MEMORY_HUGE_PAGES)
+        madvise(memory, size, MADV_HUGEPAGE);
+#endif
+    return memory;
+}
+
+// hand out the next cache line aligned piece of a memory block (only counts bytes when base is NULL)
+static void *carve_memory(uint8_t *base, size_t *offset, const size_t size) {
+    void *memory = (base != NULL) ? base + *offset : NULL;
+    *offset += (size + 63) & ~(size_t)63;
+    return memory;
+}
+
+// point the tables of a worker into base, returns the amount of bytes they need
+static size_t layout_worker(worker_t *worker, uint8_t *base) {
+    const size_t clients = (size_t)state.config.clients;
+    size_t offset = 0;
+    worker->active = carve_memory(base, &offset, clients * sizeof(*worker->active));
+    worker->position = carve_memory(base, &offset, clients * sizeof(*worker->position));
+    worker->wheel = carve_memory(base, &offset, (size_t)state.config.wheel * sizeof(*worker->wheel));
+    worker->timers = carve_memory(base, &offset, clients * sizeof(*worker->timers));
+    worker->clients = carve_memory(base, &offset, clients * sizeof(*worker->clients));
+    worker->sessions = carve_memory(base, &offset, clients * sizeof(*worker->sessions));
+    worker->index = carve_memory(base, &offset, (size_t)state.config.index * sizeof(*worker->index));
+    worker->free = carve_memory(base, &offset, clients * sizeof(*worker->free));
+    worker->jobs = carve_memory(base, &offset, (clients + JOB_CLIENTS - 1) / JOB_CLIENTS * sizeof(*worker->jobs));
+    worker->limits = carve_memory(base, &offset, clients * sizeof(*worker->limits));
+    worker->strangers = carve_memory(base, &offset, (size_t)state.config.strangers * sizeof(*worker->strangers));
+    worker->video = carve_memory(base, &offset, clients * sizeof(*worker->video));
+    worker->history = carve_memory(base, &offset, clients * sizeof(*worker->history));
+    worker->frames = carve_memory(base, &offset, clients * sizeof(*worker->frames));
+    worker->cache = carve_memory(base, &offset, (size_t)state.config.screens * NETWORK_CACHE * sizeof(*worker->cache));
+    worker->send.size = clients * NETWORK_FRAME;
+    worker->send.data = carve_memory(base, &offset, worker->send.size);
+    worker->send.iov = carve_memory(base, &offset, clients * 2 * sizeof(*worker->send.iov));
+    worker->send.addr = carve_memory(base, &offset, clients * sizeof(*worker->send.addr));
+    worker->send.msgs = carve_memory(base, &offset, clients * sizeof(*worker->send.msgs));
+    worker->record.data = carve_memory(base, &offset, (state.config.record != NULL) ? RECORD_BUFFER : 0);
+    return offset;
+}
+
+// map the snapshot file, a snapshot of another configuration (or none at all) starts out empty
+static void init_snapshot(void) {
+    if (state.config.snapshot == NULL) return;
+    size_t offset = 0;
+    carve_memory(NULL, &offset, sizeof(snapshot_header_t));
+    const size_t screens = offset;
+    carve_memory(NULL, &offset, (size_t)state.config.screens * sizeof(*state.snapshot.screens));
+    const size_t slots = offset;
+    carve_memory(NULL, &offset, (size_t)state.config.workers * state.config.clients * sizeof(snapshot_slot_t));
+    state.snapshot.size = offset;
+    // check whether the file holds a snapshot we can resume from
+    const snapshot_header_t expected = {
+        .magic = SNAPSHOT_MAGIC, .version = SNAPSHOT_VERSION, .slot_size = sizeof(snapshot_slot_t),
+        .workers = state.config.workers, .clients = state.config.clients, .screens = state.config.screens,
+    };
+    snapshot_header_t header;
+    struct stat st;
+    if ((state.snapshot.fd = open(state.config.snapshot, O_RDWR | O_CREAT, 0644)) == -1)
+        panic("open(%s) failed: %s", state.config.snapshot, strerror(errno));
+    if (fstat(state.snapshot.fd, &st))
+        panic("fstat(%s) failed: %s", state.config.snapshot, strerror(errno));
+    state.snapshot.restore = ((size_t)st.st_size == state.snapshot.size)
+        && (pread(state.snapshot.fd, &header, sizeof(header), 0) == (ssize_t)sizeof(header))
+        && !memcmp(header.magic, expected.magic, sizeof(header.magic)) && (header.version == expected.version)
+        && (header.slot_size == expected.slot_size) && (header.workers == expected.workers)
+        && (header.clients == expected.clients) && (header.screens == expected.screens);
+    if (!state.snapshot.restore) {
+        if (st.st_size > 0)
+            logger("Snapshot %s does not match our configuration, starting without sessions", state.config.snapshot);
+        if (ftruncate(state.snapshot.fd, 0))
+            panic("ftruncate(%s) failed: %s", state.config.snapshot, strerror(errno));
+    }
+    // reserve the blocks up front, running out of disk space in a mapping would kill us
+    const int error = posix_fallocate(state.snapshot.fd, 0, (off_t)state.snapshot.size);
+    if (error)
+        panic("posix_fallocate(%s) failed: %s", state.config.snapshot, strerror(error));
+    state.snapshot.data = mmap(NULL, state.snapshot.size, PROT_READ | PROT_WRITE, MAP_SHARED, state.snapshot.fd, 0);
+    if (state.snapshot.data == MAP_FAILED)
+        panic("mmap(%s) failed: %s", state.config.snapshot, strerror(errno));
+    state.snapshot.header = (snapshot_header_t*)state.snapshot.data;
+    state.snapshot.screens = (void*)&state.snapshot.data[screens];
+    state.snapshot.slots = (snapshot_slot_t*)&state.snapshot.data[slots];
+    if (state.snapshot.restore) {
+        // continue with the tick and the shared screens of the snapshot, the workers pick up their sessions
+        state.tick = state.snapshot.header->tick;
+        if (state.config.screens > 0)
+            memcpy(state.screens.video, state.snapshot.screens, (size_t)state.config.screens * sizeof(*state.screens.video));
+    } else {
+        *state.snapshot.header = expected;
+    }
+    if (pthread_create(&state.snapshot.thread, NULL, run_snapshot, NULL))
+        panic("pthread_create() failed");
+    atexit(quit_snapshot);
+}
+
+// open a recording for replay and take over the configuration it was recorded with
+static void init_replay(void) {
+    record_header_t header;
+    if ((state.record.file = fopen(state.config.replay, "rb")) == NULL)
+        panic("fopen(%s) failed: %s", state.config.replay, strerror(errno));
+    // the configuration has to be one the command line accepts, the tables are sized from it
+    if ((fread(&header, sizeof(header), 1, state.record.file) != 1) || memcmp(header.magic, RECORD_MAGIC, sizeof(header.magic))
+        || (header.version != RECORD_VERSION) || (header.workers < 1) || (header.workers > NETWORK_WORKERS_MAX)
+        || (header.clients < 1) || (header.clients > NETWORK_CLIENTS_MAX) || (header.tick_rate < 1) || (header.tick_rate > TICK_RATE_MAX)
+        || (header.screens < 0) || (header.screens > NETWORK_SCREENS_MAX) || (header.rate < 0) || (header.rate > NETWORK_RATE_MAX)
+        || (header.timeout < (uint32_t)header.tick_rate) || (header.timeout > (uint32_t)NETWORK_TIMEOUT_MAX * header.tick_rate))
+        panic("%s is no recording of this server version", state.config.replay);
+    state.config.workers = header.workers;
+    state.config.clients = header.clients;
+    state.config.tick_rate = header.tick_rate;
+    state.config.screens = header.screens;
+    state.config.rate = header.rate;
+    state.config.timeout = header.timeout;
+    memcpy(state.secret, header.secret, sizeof(state.secret));
+    state.tick = state.record.first_tick = header.tick;
+}
+
+// create the recording and write its header (needs the final cookie key), or load the first records of a replay
+static void init_record(void) {
+    if (state.config.replay != NULL) {
+        logger("Replaying %s ...", state.config.replay);
+        load_records();
+        atexit(quit_record);
+        return;
+    }
+    if (state.config.record == NULL) return;
+    const record_header_t header = {
+        .magic = RECORD_MAGIC, .version = RECORD_VERSION, .workers = state.config.workers, .clients = state.config.clients,
+        .tick_rate = state.config.tick_rate, .screens = state.config.screens, .rate = state.config.rate,
+        .timeout = state.config.timeout, .tick = state.tick, .secret = { state.secret[0], state.secret[1] },
+    };
+    if ((state.record.file = fopen(state.config.record, "wb")) == NULL)
+        panic("fopen(%s) failed: %s", state.config.record, strerror(errno));
+    if (fwrite(&header, sizeof(header), 1, state.record.file) != 1)
+        panic("fwrite(%s) failed: %s", state.config.record, strerror(errno));
+    pthread_mutex_init(&state.record.mutex, NULL);
+    atexit(quit_record);
+}
+
+// allocate the tables and open the UDP socket of a worker
+static void init_worker(worker_t *worker, const int id) {
+    worker->id = id;
+    // every worker could end up with all clients, untouched slots never get backed by memory
+    layout_worker(worker, allocate_memory(layout_worker(worker, NULL)));
+    init_clients(worker);
+    restore_sessions(worker);
+    init_receive(worker);
+    worker->challenges = NETWORK_CHALLENGES;
+    // a replay has no socket, its packets come from the recording
+    worker->family = AF_INET6;
+    if (state.config.replay != NULL) {
+        worker->udp = -1;
+        return;
+    }
+    // open UDP server socket (all workers share the port), dual-stack unless the host has no IPv6
+    if ((worker->udp = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP)) != -1) {
+        const int disable = 0;
+        if (setsockopt(worker->udp, IPPROTO_IPV6, IPV6_V6ONLY, &disable, sizeof(disable)))
+            panic("setsockopt(IPV6_V6ONLY) failed: %s", strerror(errno));
+    } else if ((errno == EAFNOSUPPORT) || (errno == EPROTONOSUPPORT)) {
+        worker->family = AF_INET;
+        if ((worker->udp = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1)
+            panic("socket() failed: %s", strerror(errno));
+    } else {
         panic("socket() failed: %s", strerror(errno));
-    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(NETWORK_PORT), .sin_addr.s_addr = INADDR_ANY };
-    if (bind(state.net.udp, (const struct sockaddr*)&addr, sizeof(addr)))
+    }
+    if (state.config.workers > 1) {
+#if defined(SO_REUSEPORT_LB)
+        const int option = SO_REUSEPORT_LB; // FreeBSD only balances datagrams with this one
+#elif defined(SO_REUSEPORT) && defined(__linux__)
+        const int option = SO_REUSEPORT;
+#else
+        const int option = -1;
+        panic("multiple workers need a load balancing SO_REUSEPORT");
+#endif
+        const int enable = 1;
+        if (setsockopt(worker->udp, SOL_SOCKET, option, &enable, sizeof(enable)))
+            panic("setsockopt(SO_REUSEPORT) failed: %s", strerror(errno));
+    }
+    endpoint_t addr;
+    const socklen_t addr_len = make_endpoint(worker, &(address_t){ .port = htons(state.config.port) }, &addr);
+    if (bind(worker->udp, &addr.sa, addr_len))
         panic("bind() failed: %s", strerror(errno));
-    if (fcntl(state.net.udp, F_SETFL, O_NONBLOCK, 1))
+    if (fcntl(worker->udp, F_SETFL, O_NONBLOCK, 1))
         panic("fcntl() failed: %s", strerror(errno));
+    // make room for a whole tick of packets in the socket buffers (the kernel may clamp this)
+    const int buffer_size = NETWORK_BUFFER;
+    setsockopt(worker->udp, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof(buffer_size));
+    setsockopt(worker->udp, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    // register the socket with the readiness API
+#if defined(HAVE_EPOLL)
+    struct epoll_event event = { .events = EPOLLIN, .data.fd = worker->udp };
+    if (((worker->poll = epoll_create1(0)) == -1) || epoll_ctl(worker->poll, EPOLL_CTL_ADD, worker->udp, &event))
+        panic("epoll() failed: %s", strerror(errno));
+#elif defined(HAVE_KQUEUE)
+    struct kevent event;
+    EV_SET(&event, worker->udp, EVFILT_READ, EV_ADD, 0, 0, NULL);
+    if (((worker->poll = kqueue()) == -1) || kevent(worker->poll, &event, 1, NULL, 0, NULL))
+        panic("kqueue() failed: %s", strerror(errno));
+#endif
+}
+
+// return the smallest power of two which is at least x
+static int power_of_two(const int x) {
+    int n = 1;
+    while (n < x) n *= 2;
+    return n;
+}
+
+// show command line usage and quit
+static void usage(const char *program) {
+    fprintf(stderr, "usage: %s [-p port] [-c clients] [-r tick rate] [-t timeout secs] [-w workers] [-s stats interval secs] [-v shared screens] [-S snapshot file] [-l packets per second and address]\n", program);
+    fprintf(stderr, "       %s -R recording file [options] (record all received packets)\n", program);
+    fprintf(stderr, "       %s -P recording file [-s stats interval secs] (replay a recording without sockets, as fast as possible)\n", program);
+    fprintf(stderr, "defaults: -p %d -c %d -r %d -t %d -w %d -s %d -v %d -l %d (SIGUSR1 logs statistics at any time, -l 0 = no limit)\n",
+        NETWORK_PORT, NETWORK_CLIENTS, TICK_RATE, NETWORK_TIMEOUT, NETWORK_WORKERS, STATS_INTERVAL, NETWORK_SCREENS, NETWORK_RATE);
+    exit(EXIT_FAILURE);
+}
+
+// parse a numeric command line option within the given limits
+static int parse_option(const char *program, const char *arg, const int min, const int max) {
+    char *end;
+    const long x = strtol(arg, &end, 10);
+    if ((*arg == '\0') || (*end != '\0') || (x < min) || (x > max))
+        usage(program);
+    return (int)x;
+}
+
+// read the configuration from the command line
+static void parse_config(int argc, char **argv) {
+    int port = NETWORK_PORT, clients = NETWORK_CLIENTS, tick_rate = TICK_RATE, timeout = NETWORK_TIMEOUT, workers = NETWORK_WORKERS;
+    int stats_interval = STATS_INTERVAL, screens = NETWORK_SCREENS, rate = NETWORK_RATE;
+    const char *snapshot = NULL, *record = NULL, *replay = NULL;
+    for (int option; (option = getopt(argc, argv, "p:c:r:t:w:s:v:S:l:R:P:h")) != -1;) {
+        switch (option) {
+            case 'p': port = parse_option(argv[0], optarg, 1, 65535); break;
+            case 'c': clients = parse_option(argv[0], optarg, 1, NETWORK_CLIENTS_MAX); break;
+            case 'r': tick_rate = parse_option(argv[0], optarg, 1, TICK_RATE_MAX); break;
+            case 't': timeout = parse_option(argv[0], optarg, 1, NETWORK_TIMEOUT_MAX); break;
+            case 'w': workers = parse_option(argv[0], optarg, 1, NETWORK_WORKERS_MAX); break;
+            case 's': stats_interval = parse_option(argv[0], optarg, 0, 86400); break;
+            case 'v': screens = parse_option(argv[0], optarg, 0, NETWORK_SCREENS_MAX); break;
+            case 'S': snapshot = optarg; break;
+            case 'l': rate = parse_option(argv[0], optarg, 0, NETWORK_RATE_MAX); break;
+            case 'R': record = optarg; break;
+            case 'P': replay = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    // a recording starts from an empty server, resumed sessions would be missing in the replay
+    if ((optind != argc) || ((snapshot != NULL) + (record != NULL) + (replay != NULL) > 1))
+        usage(argv[0]);
+    state.config.port = port;
+    state.config.clients = clients;
+    state.config.tick_rate = tick_rate;
+    state.config.timeout = (uint32_t)timeout * tick_rate;
+    state.config.workers = workers;
+    state.config.stats_interval = stats_interval;
+    state.config.screens = screens;
+    state.config.snapshot = snapshot;
+    state.config.rate = rate;
+    state.config.record = record;
+    state.config.replay = replay;
+    if (replay != NULL)
+        init_replay();
+    state.config.tick_time = 1.0 / (double)state.config.tick_rate;
+    state.config.burst = (uint32_t)state.config.rate * state.config.tick_rate;
+    state.config.cookie = (uint32_t)NETWORK_COOKIE * state.config.tick_rate;
+    // keep the address index at most half full and the timeout wheel larger than the timeout
+    state.config.index = power_of_two(state.config.clients * 2);
+    state.config.wheel = power_of_two(state.config.timeout + 2);
+    state.config.strangers = state.config.index;
+}
+
+// initialize the server
+static void init_server(int argc, char **argv) {
+    // init state
+    state.running = 1;
+    parse_config(argc, argv);
+    init_logger();
+    atexit(quit_server);
+    logger("Starting server on port %d (%d clients, %d ticks per second, %d workers) ...",
+        state.config.port, state.config.clients, state.config.tick_rate, state.config.workers);
+    if ((state.workers = calloc(state.config.workers, sizeof(worker_t))) == NULL)
+        panic("calloc() failed: out of memory");
+    if (state.config.screens > 0) {
+        state.screens.video = allocate_memory((size_t)state.config.screens * sizeof(*state.screens.video));
+        state.screens.history = allocate_memory((size_t)state.config.screens * NETWORK_HISTORY * sizeof(*state.screens.history));
+    }
+    // key the connection cookies, nobody can compute them for addresses they do not receive at (a replay has its key)
+    if (state.config.replay == NULL) {
+        const int random = open("/dev/urandom", O_RDONLY);
+        if ((random == -1) || (read(random, state.secret, sizeof(state.secret)) != (ssize_t)sizeof(state.secret)))
+            panic("read(/dev/urandom) failed: %s", strerror(errno));
+        close(random);
+    }
+    init_snapshot();
+    init_record();
+    for (int i = 0; i < state.config.workers; ++i)
+        init_worker(&state.workers[i], i);
+    if (state.connected > 0)
+        logger("Resumed %d sessions from %s", state.connected, state.config.snapshot);
+    pthread_mutex_init(&state.barrier.mutex, NULL);
+    pthread_cond_init(&state.barrier.cond, NULL);
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+    signal(SIGUSR1, handle_signal);
 }
 
 // main entry point
-int main(void) {
-    init_server();
+int main(int argc, char **argv) {
+    init_server(argc, argv);
     run_server();
     return 0;
 }